@@ -13,10 +13,11 @@ VERSION = `git log -1 --format=dev-%h`
 
 CFLAGS = -g -Wall -pedantic -Wextra -std=c11 -Wno-unused-parameter
 
-CFLAGS += -D_POSIX_C_SOURCE=200809L \
+CFLAGS += -D_XOPEN_SOURCE=700 \
 		  -DVERSION=\"$(VERSION)\" \
 		  -DGAME_DATA_DIR=\"$(GAME_DATA_DIR)\"
 
-## Disable cpu specific vector operations which doesn't work on certain
-## compilers.
-CFLAGS += -DSDL_DISABLE_IMMINTRIN_H
+## The vector kernels in src/blit.c are chosen at runtime depending on the cpu.
+## Uncomment this for compilers which can't build cpu specific vector
+## operations, SDL's own use of them is disabled as well.
+# CFLAGS += -DNO_SIMD -DSDL_DISABLE_IMMINTRIN_H
@@ -0,0 +1,178 @@
+/*
+ *  Copyright 2021 Shaqeel Ahmad
+ *
+ *  This file is part of fuyunix.
+ *
+ *  fuyunix is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fuyunix is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fuyunix.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cairo.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "asset.h"
+#include "pool.h"
+#include "util.h"
+
+void
+asset_Init(struct Assets *a,
+		bool (*resolve)(char *path, char *key),
+		cairo_surface_t *(*load)(char *key))
+{
+	*a = (struct Assets){0};
+	a->resolve = resolve;
+	a->load = load;
+}
+
+/* Returns the entry cached under key, adding an empty one if there's
+ * none */
+static int
+findEntry(struct Assets *a, char *key)
+{
+	int id = -1;
+	for (int i = 0; i < a->len; i++) {
+		if (strcmp(a->entries[i].path, key) == 0) {
+			id = i;
+			break;
+		}
+	}
+	if (id < 0) {
+		a->entries = erealloc(a->entries,
+				(a->len + 1) * sizeof(*a->entries));
+		id = a->len++;
+		a->entries[id] = (struct asset_Entry){0};
+		a->entries[id].path = ecalloc(strlen(key) + 1, 1);
+		strcpy(a->entries[id].path, key);
+	}
+	return id;
+}
+
+struct PrefetchJob {
+	struct Assets *a;
+	struct asset_Entry *e;
+};
+
+static void
+prefetchEntry(void *arg)
+{
+	struct PrefetchJob *job = arg;
+	struct asset_Entry *e = job->e;
+	e->surf = job->a->load(e->path);
+	free(job);
+}
+
+/* Starts decoding the images in paths which aren't cached yet, each one
+ * as a job of group */
+void
+asset_Prefetch(struct Assets *a, char **paths, int n, struct pool_Group *group)
+{
+	/* All the entries are added first, the jobs hold pointers to them */
+	int *ids = ecalloc(n ? n : 1, sizeof(*ids));
+	for (int i = 0; i < n; i++) {
+		char real[PATH_MAX];
+		ids[i] = a->resolve(paths[i], real) ? findEntry(a, real) : -1;
+	}
+	for (int i = 0; i < n; i++) {
+		if (ids[i] < 0)
+			continue;
+		struct asset_Entry *e = &a->entries[ids[i]];
+		/* Paths resolving to the same image are only decoded once */
+		bool queued = false;
+		for (int j = 0; j < i; j++)
+			queued = queued || ids[j] == ids[i];
+		if (e->surf != NULL || queued)
+			continue;
+		struct PrefetchJob *job = ecalloc(1, sizeof(*job));
+		job->a = a;
+		job->e = e;
+		pool_Submit(group, prefetchEntry, job);
+	}
+	free(ids);
+}
+
+/* Returns a handle to the image at path, or -1 if it can't be loaded */
+int
+asset_Load(struct Assets *a, char *path)
+{
+	char real[PATH_MAX];
+	if (!a->resolve(path, real))
+		return -1;
+
+	int id = findEntry(a, real);
+	struct asset_Entry *e = &a->entries[id];
+	if (e->surf == NULL) {
+		e->surf = a->load(real);
+		if (e->surf == NULL)
+			return -1;
+	}
+	e->refs++;
+	return id;
+}
+
+/* Returns a handle to the first of the n images in paths that loads */
+int
+asset_LoadFirst(struct Assets *a, char **paths, int n)
+{
+	for (int i = 0; i < n; i++) {
+		if (paths[i] == NULL)
+			continue;
+		int id = asset_Load(a, paths[i]);
+		if (id >= 0)
+			return id;
+	}
+	return -1;
+}
+
+cairo_surface_t *
+asset_Surface(struct Assets *a, int handle)
+{
+	if (handle < 0)
+		return NULL;
+	return a->entries[handle].surf;
+}
+
+void
+asset_Release(struct Assets *a, int handle)
+{
+	if (handle < 0)
+		return;
+	a->entries[handle].refs--;
+}
+
+/* Frees every image nobody holds a handle to */
+void
+asset_Purge(struct Assets *a)
+{
+	for (int i = 0; i < a->len; i++) {
+		struct asset_Entry *e = &a->entries[i];
+		if (e->surf == NULL || e->refs > 0)
+			continue;
+		cairo_surface_destroy(e->surf);
+		e->surf = NULL;
+	}
+}
+
+void
+asset_Free(struct Assets *a)
+{
+	for (int i = 0; i < a->len; i++) {
+		if (a->entries[i].surf != NULL)
+			cairo_surface_destroy(a->entries[i].surf);
+		free(a->entries[i].path);
+	}
+	free(a->entries);
+	*a = (struct Assets){0};
+}
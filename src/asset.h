@@ -0,0 +1,43 @@
+#ifndef _ASSET_H_
+#define _ASSET_H_
+
+/*
+ * Images loaded from disk, cached by the path they resolve to so the same
+ * file is only decoded once however many times it's asked for. Handles are
+ * counted references, -1 is used for images which failed to load. Images
+ * nobody holds a handle to stay cached until asset_Purge.
+ *
+ * asset_Prefetch decodes images on the worker pool ahead of time. The cache
+ * mustn't be used until the group is waited on.
+ */
+
+struct pool_Group;
+
+struct asset_Entry {
+	char *path;
+	cairo_surface_t *surf;
+	int refs;
+};
+
+struct Assets {
+	struct asset_Entry *entries;
+	int len;
+	/* Turns a path into the key images are cached by, the key is what's
+	 * passed to load */
+	bool (*resolve)(char *path, char *key);
+	cairo_surface_t *(*load)(char *key);
+};
+
+void asset_Init(struct Assets *a,
+		bool (*resolve)(char *path, char *key),
+		cairo_surface_t *(*load)(char *key));
+void asset_Prefetch(struct Assets *a, char **paths, int n,
+		struct pool_Group *group);
+int asset_Load(struct Assets *a, char *path);
+int asset_LoadFirst(struct Assets *a, char **paths, int n);
+cairo_surface_t *asset_Surface(struct Assets *a, int handle);
+void asset_Release(struct Assets *a, int handle);
+void asset_Purge(struct Assets *a);
+void asset_Free(struct Assets *a);
+
+#endif /* _ASSET_H_ */
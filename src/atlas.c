@@ -0,0 +1,163 @@
+/*
+ *  Copyright 2021 Shaqeel Ahmad
+ *
+ *  This file is part of fuyunix.
+ *
+ *  fuyunix is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fuyunix is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fuyunix.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cairo.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "game.h"
+#include "util.h"
+#include "atlas.h"
+
+#define ATLAS_MIN_WIDTH 256
+/* Border around each texture repeating its edge pixels, so sampling just
+ * outside a texture when it's scaled or drawn at a fraction of a pixel
+ * doesn't pick up its neighbours */
+#define ATLAS_PAD 1
+
+/* Adds src to the atlas and returns its index. The atlas takes ownership of
+ * src, which is freed by atlas_Build. A surface added again gets the index
+ * it got the first time. */
+int
+atlas_Add(struct Atlas *atlas, cairo_surface_t *src)
+{
+	if (src == NULL)
+		return -1;
+
+	for (int i = 0; atlas->pending != NULL && i < atlas->len; i++) {
+		if (atlas->pending[i] == src) {
+			cairo_surface_destroy(src);
+			return i;
+		}
+	}
+
+	atlas->len++;
+	atlas->pending = erealloc(atlas->pending,
+			atlas->len * sizeof(*atlas->pending));
+	atlas->rects = erealloc(atlas->rects, atlas->len * sizeof(*atlas->rects));
+	atlas->opaque = erealloc(atlas->opaque, atlas->len * sizeof(*atlas->opaque));
+	atlas->pending[atlas->len-1] = src;
+	atlas->opaque[atlas->len-1] =
+		cairo_image_surface_get_format(src) == CAIRO_FORMAT_RGB24;
+	atlas->rects[atlas->len-1] = (struct game_Rect){
+		.x = 0,
+		.y = 0,
+		.w = cairo_image_surface_get_width(src),
+		.h = cairo_image_surface_get_height(src),
+	};
+	return atlas->len-1;
+}
+
+static struct Atlas *sortAtlas;
+
+static int
+cmpHeight(const void *a, const void *b)
+{
+	int i = *(const int *)a;
+	int j = *(const int *)b;
+	return sortAtlas->rects[j].h - sortAtlas->rects[i].h;
+}
+
+/* Packs all the added textures into rows ordered by height and copies them
+ * into one premultiplied ARGB32 surface, each with an ATLAS_PAD border. */
+bool
+atlas_Build(struct Atlas *atlas)
+{
+	if (atlas->len == 0)
+		return true;
+
+	int *order = ecalloc(atlas->len, sizeof(*order));
+	long area = 0;
+	int width = ATLAS_MIN_WIDTH;
+	for (int i = 0; i < atlas->len; i++) {
+		order[i] = i;
+		int w = atlas->rects[i].w + 2 * ATLAS_PAD;
+		int h = atlas->rects[i].h + 2 * ATLAS_PAD;
+		area += (long)w * h;
+		if (w > width)
+			width = w;
+	}
+	while ((long)width * width < area)
+		width *= 2;
+
+	sortAtlas = atlas;
+	qsort(order, atlas->len, sizeof(*order), cmpHeight);
+	sortAtlas = NULL;
+
+	int x = 0, y = 0, rowHeight = 0;
+	for (int i = 0; i < atlas->len; i++) {
+		struct game_Rect *r = &atlas->rects[order[i]];
+		int w = r->w + 2 * ATLAS_PAD;
+		int h = r->h + 2 * ATLAS_PAD;
+		if (x + w > width) {
+			x = 0;
+			y += rowHeight;
+			rowHeight = 0;
+		}
+		r->x = x + ATLAS_PAD;
+		r->y = y + ATLAS_PAD;
+		x += w;
+		if (h > rowHeight)
+			rowHeight = h;
+	}
+	free(order);
+
+	atlas->surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+			width, y + rowHeight);
+	if (cairo_surface_status(atlas->surf) != CAIRO_STATUS_SUCCESS) {
+		fprintf(stderr, "cairo: %s\n",
+				cairo_status_to_string(cairo_surface_status(atlas->surf)));
+		return false;
+	}
+
+	cairo_t *cr = cairo_create(atlas->surf);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	for (int i = 0; i < atlas->len; i++) {
+		struct game_Rect r = atlas->rects[i];
+		cairo_set_source_surface(cr, atlas->pending[i], r.x, r.y);
+		cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_PAD);
+		cairo_rectangle(cr, r.x - ATLAS_PAD, r.y - ATLAS_PAD,
+				r.w + 2 * ATLAS_PAD, r.h + 2 * ATLAS_PAD);
+		cairo_fill(cr);
+		cairo_surface_destroy(atlas->pending[i]);
+	}
+	cairo_destroy(cr);
+	cairo_surface_flush(atlas->surf);
+
+	free(atlas->pending);
+	atlas->pending = NULL;
+	return true;
+}
+
+void
+atlas_Free(struct Atlas *atlas)
+{
+	if (atlas->pending) {
+		for (int i = 0; i < atlas->len; i++)
+			cairo_surface_destroy(atlas->pending[i]);
+		free(atlas->pending);
+	}
+	if (atlas->surf)
+		cairo_surface_destroy(atlas->surf);
+	free(atlas->rects);
+	free(atlas->opaque);
+	*atlas = (struct Atlas){0};
+}
@@ -0,0 +1,22 @@
+#ifndef _ATLAS_H_
+#define _ATLAS_H_
+
+/*
+ * All the small textures of the game (tiles, player frames, ...) packed into
+ * a single image surface. Textures are referred to by the index returned by
+ * atlas_Add, -1 is used for textures which failed to load. Textures added as
+ * RGB24 surfaces are marked opaque.
+ */
+struct Atlas {
+	cairo_surface_t *surf;
+	struct game_Rect *rects;
+	bool *opaque;
+	cairo_surface_t **pending;
+	int len;
+};
+
+int atlas_Add(struct Atlas *atlas, cairo_surface_t *src);
+bool atlas_Build(struct Atlas *atlas);
+void atlas_Free(struct Atlas *atlas);
+
+#endif /* _ATLAS_H_ */
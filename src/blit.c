@@ -0,0 +1,195 @@
+/*
+ *  Copyright 2021 Shaqeel Ahmad
+ *
+ *  This file is part of fuyunix.
+ *
+ *  fuyunix is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fuyunix is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fuyunix.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "blit.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(NO_SIMD)
+#define BLIT_X86
+#include <immintrin.h>
+#endif
+
+typedef void (*RowFunc)(uint32_t *dst, const uint32_t *src, int n);
+
+static void
+copyRowScalar(uint32_t *dst, const uint32_t *src, int n)
+{
+	memcpy(dst, src, n * sizeof(*dst));
+}
+
+/* dst = src + dst * (255 - src.alpha) / 255, for all 4 channels at once */
+static inline uint32_t
+overPixel(uint32_t s, uint32_t d)
+{
+	uint32_t ia = 255 - (s >> 24);
+	uint32_t rb = (d & 0x00FF00FF) * ia + 0x00800080;
+	rb = ((rb + ((rb >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+	uint32_t ag = ((d >> 8) & 0x00FF00FF) * ia + 0x00800080;
+	ag = (ag + ((ag >> 8) & 0x00FF00FF)) & 0xFF00FF00;
+	return s + rb + ag;
+}
+
+static void
+overRowScalar(uint32_t *dst, const uint32_t *src, int n)
+{
+	for (int i = 0; i < n; i++) {
+		uint32_t s = src[i];
+		uint32_t a = s >> 24;
+		if (a == 0xFF)
+			dst[i] = s;
+		else if (s != 0)
+			dst[i] = overPixel(s, dst[i]);
+	}
+}
+
+#ifdef BLIT_X86
+__attribute__((target("sse2"))) static void
+copyRowSSE2(uint32_t *dst, const uint32_t *src, int n)
+{
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dst + i), s);
+	}
+	for (; i < n; i++)
+		dst[i] = src[i];
+}
+
+/* Multiplies the 16 bit channels of d by 255 - alpha of s and divides by
+ * 255 with rounding, same as overPixel. */
+__attribute__((target("sse2"))) static inline __m128i
+mulInvAlphaSSE2(__m128i s, __m128i d)
+{
+	__m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s,
+				_MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+	__m128i ia = _mm_sub_epi16(_mm_set1_epi16(0xFF), a);
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(d, ia), _mm_set1_epi16(0x80));
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("sse2"))) static void
+overRowSSE2(uint32_t *dst, const uint32_t *src, int n)
+{
+	__m128i zero = _mm_setzero_si128();
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+		__m128i lo = mulInvAlphaSSE2(_mm_unpacklo_epi8(s, zero),
+				_mm_unpacklo_epi8(d, zero));
+		__m128i hi = mulInvAlphaSSE2(_mm_unpackhi_epi8(s, zero),
+				_mm_unpackhi_epi8(d, zero));
+		d = _mm_adds_epu8(s, _mm_packus_epi16(lo, hi));
+		_mm_storeu_si128((__m128i *)(dst + i), d);
+	}
+	overRowScalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+copyRowAVX2(uint32_t *dst, const uint32_t *src, int n)
+{
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+		_mm256_storeu_si256((__m256i *)(dst + i), s);
+	}
+	for (; i < n; i++)
+		dst[i] = src[i];
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+mulInvAlphaAVX2(__m256i s, __m256i d)
+{
+	__m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s,
+				_MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+	__m256i ia = _mm256_sub_epi16(_mm256_set1_epi16(0xFF), a);
+	__m256i t = _mm256_add_epi16(_mm256_mullo_epi16(d, ia),
+			_mm256_set1_epi16(0x80));
+	return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("avx2"))) static void
+overRowAVX2(uint32_t *dst, const uint32_t *src, int n)
+{
+	__m256i zero = _mm256_setzero_si256();
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+		__m256i lo = mulInvAlphaAVX2(_mm256_unpacklo_epi8(s, zero),
+				_mm256_unpacklo_epi8(d, zero));
+		__m256i hi = mulInvAlphaAVX2(_mm256_unpackhi_epi8(s, zero),
+				_mm256_unpackhi_epi8(d, zero));
+		d = _mm256_adds_epu8(s, _mm256_packus_epi16(lo, hi));
+		_mm256_storeu_si256((__m256i *)(dst + i), d);
+	}
+	overRowScalar(dst + i, src + i, n - i);
+}
+#endif /* BLIT_X86 */
+
+static struct {
+	const char *name;
+	RowFunc copy;
+	RowFunc over;
+} kernels = {"scalar", copyRowScalar, overRowScalar};
+
+void
+blit_Init(void)
+{
+#ifdef BLIT_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		kernels.name = "avx2";
+		kernels.copy = copyRowAVX2;
+		kernels.over = overRowAVX2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		kernels.name = "sse2";
+		kernels.copy = copyRowSSE2;
+		kernels.over = overRowSSE2;
+	}
+#endif
+}
+
+const char *
+blit_Name(void)
+{
+	return kernels.name;
+}
+
+void
+blit_Copy(uint8_t *dst, int dstStride, const uint8_t *src, int srcStride,
+		int w, int h)
+{
+	for (int y = 0; y < h; y++) {
+		kernels.copy((uint32_t *)(dst + y * dstStride),
+				(const uint32_t *)(src + y * srcStride), w);
+	}
+}
+
+void
+blit_Over(uint8_t *dst, int dstStride, const uint8_t *src, int srcStride,
+		int w, int h)
+{
+	for (int y = 0; y < h; y++) {
+		kernels.over((uint32_t *)(dst + y * dstStride),
+				(const uint32_t *)(src + y * srcStride), w);
+	}
+}
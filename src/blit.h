@@ -0,0 +1,16 @@
+#ifndef _BLIT_H_
+#define _BLIT_H_
+
+/*
+ * Copies of premultiplied ARGB32 pixels between image buffers, used instead
+ * of cairo when nothing but an integer translation is involved. The fastest
+ * kernels supported by the cpu are picked by blit_Init.
+ */
+void blit_Init(void);
+const char *blit_Name(void);
+void blit_Copy(uint8_t *dst, int dstStride, const uint8_t *src, int srcStride,
+		int w, int h);
+void blit_Over(uint8_t *dst, int dstStride, const uint8_t *src, int srcStride,
+		int w, int h);
+
+#endif /* _BLIT_H_ */
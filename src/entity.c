@@ -0,0 +1,135 @@
+/*
+ *  Copyright 2021 Shaqeel Ahmad
+ *
+ *  This file is part of fuyunix.
+ *
+ *  fuyunix is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fuyunix is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fuyunix.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "entity.h"
+#include "util.h"
+
+void
+entity_Init(struct Entities *e, int cap)
+{
+	*e = (struct Entities){0};
+	e->cap = cap;
+	e->x = ecalloc(cap, sizeof(*e->x));
+	e->y = ecalloc(cap, sizeof(*e->y));
+	e->prev_x = ecalloc(cap, sizeof(*e->prev_x));
+	e->prev_y = ecalloc(cap, sizeof(*e->prev_y));
+	e->dx = ecalloc(cap, sizeof(*e->dx));
+	e->dy = ecalloc(cap, sizeof(*e->dy));
+	e->w = ecalloc(cap, sizeof(*e->w));
+	e->h = ecalloc(cap, sizeof(*e->h));
+	e->type = ecalloc(cap, sizeof(*e->type));
+	e->flags = ecalloc(cap, sizeof(*e->flags));
+	e->owner = ecalloc(cap, sizeof(*e->owner));
+	e->age = ecalloc(cap, sizeof(*e->age));
+	e->free = ecalloc(cap, sizeof(*e->free));
+}
+
+/* Returns the slot of the new entity, or -1 if the store is full */
+int
+entity_Spawn(struct Entities *e, enum entity_Type type,
+		float x, float y, float w, float h)
+{
+	int id;
+	if (e->free_len > 0)
+		id = e->free[--e->free_len];
+	else if (e->len < e->cap)
+		id = e->len++;
+	else
+		return -1;
+
+	e->x[id] = e->prev_x[id] = x;
+	e->y[id] = e->prev_y[id] = y;
+	e->dx[id] = 0;
+	e->dy[id] = 0;
+	e->w[id] = w;
+	e->h[id] = h;
+	e->type[id] = type;
+	e->flags[id] = ENTITY_ALIVE;
+	e->owner[id] = -1;
+	e->age[id] = 0;
+	e->count++;
+	return id;
+}
+
+void
+entity_Despawn(struct Entities *e, int id)
+{
+	if (!(e->flags[id] & ENTITY_ALIVE))
+		return;
+	e->flags[id] = 0;
+	e->free[e->free_len++] = id;
+	e->count--;
+}
+
+void
+entity_Clear(struct Entities *e)
+{
+	memset(e->flags, 0, e->len * sizeof(*e->flags));
+	e->len = 0;
+	e->count = 0;
+	e->free_len = 0;
+}
+
+/* Makes dst a copy of src, dst must be at least as big */
+void
+entity_Copy(struct Entities *dst, const struct Entities *src)
+{
+	assert(dst->cap >= src->len);
+	size_t n = src->len;
+	memcpy(dst->x, src->x, n * sizeof(*dst->x));
+	memcpy(dst->y, src->y, n * sizeof(*dst->y));
+	memcpy(dst->prev_x, src->prev_x, n * sizeof(*dst->prev_x));
+	memcpy(dst->prev_y, src->prev_y, n * sizeof(*dst->prev_y));
+	memcpy(dst->dx, src->dx, n * sizeof(*dst->dx));
+	memcpy(dst->dy, src->dy, n * sizeof(*dst->dy));
+	memcpy(dst->w, src->w, n * sizeof(*dst->w));
+	memcpy(dst->h, src->h, n * sizeof(*dst->h));
+	memcpy(dst->type, src->type, n * sizeof(*dst->type));
+	memcpy(dst->flags, src->flags, n * sizeof(*dst->flags));
+	memcpy(dst->owner, src->owner, n * sizeof(*dst->owner));
+	memcpy(dst->age, src->age, n * sizeof(*dst->age));
+	memcpy(dst->free, src->free, src->free_len * sizeof(*dst->free));
+	dst->len = src->len;
+	dst->count = src->count;
+	dst->free_len = src->free_len;
+}
+
+void
+entity_Free(struct Entities *e)
+{
+	free(e->x);
+	free(e->y);
+	free(e->prev_x);
+	free(e->prev_y);
+	free(e->dx);
+	free(e->dy);
+	free(e->w);
+	free(e->h);
+	free(e->type);
+	free(e->flags);
+	free(e->owner);
+	free(e->age);
+	free(e->free);
+	*e = (struct Entities){0};
+}
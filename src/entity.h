@@ -0,0 +1,54 @@
+#ifndef _ENTITY_H_
+#define _ENTITY_H_
+
+/*
+ * Everything that moves in a level besides the players, stored as one array
+ * per field so update loops walk contiguous memory. Entities are referred to
+ * by their slot, slots of despawned entities are kept in a free list and
+ * reused. Slots below len may be in use, dead ones have ENTITY_ALIVE unset.
+ */
+
+enum entity_Type {
+	ENTITY_ENEMY,
+	ENTITY_PROJECTILE,
+	ENTITY_PICKUP,
+};
+
+#define ENTITY_ALIVE 0x01
+/* Projectile heading back to its owner */
+#define ENTITY_RETURNING 0x02
+
+struct Entities {
+	int cap;
+	int len;
+	int count;
+
+	float *x;
+	float *y;
+	/* Position at the start of the last tick, for drawing */
+	float *prev_x;
+	float *prev_y;
+	float *dx;
+	float *dy;
+	float *w;
+	float *h;
+	uint8_t *type;
+	uint8_t *flags;
+	/* Player that spawned the entity, or -1 */
+	int *owner;
+	/* Seconds since the entity spawned */
+	float *age;
+
+	int *free;
+	int free_len;
+};
+
+void entity_Init(struct Entities *e, int cap);
+int entity_Spawn(struct Entities *e, enum entity_Type type,
+		float x, float y, float w, float h);
+void entity_Despawn(struct Entities *e, int id);
+void entity_Clear(struct Entities *e);
+void entity_Copy(struct Entities *dst, const struct Entities *src);
+void entity_Free(struct Entities *e);
+
+#endif /* _ENTITY_H_ */
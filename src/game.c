@@ -20,12 +20,17 @@
 #include <assert.h>
 #include <limits.h>
 #include <math.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <cairo.h>
 #include <ft2build.h>
 #include FT_FREETYPE_H
@@ -36,25 +41,109 @@
 #include "util.h"
 #include "fuyunix.h"
 #include "scfg.h"
+#include "atlas.h"
+#include "asset.h"
+#include "pack.h"
+#include "entity.h"
+#include "pool.h"
+#include "blit.h"
+#include "replay.h"
 
 #define CAIRO_RGBA(c) (c.r / 255.0), (c.g / 255.0), (c.b / 255.0), (c.a / 255.0)
 
+/* Size of the pre-rendered pieces the static tiles of a level are baked into */
+#define CHUNK_SIZE 512
+
+#define TEXT_CACHE_SIZE 32
+#define TEXT_MAX_LEN 32
+
+/* Number of past positions of a player's trail that are drawn */
+#define TRAIL_LEN 8
+#define TRAIL_CACHE_SIZE 8
+#define MAX_ENTITIES 8192
+#define MAX_PROJECTILES 1024
+/* dy is in pixels per frame at the frame rate the physics was tuned at */
+#define DY_RATE 60
+/* Longest time simulated in one frame, so a stall doesn't snowball */
+#define MAX_FRAME_TIME 0.25
+/* How far into a region something may be and still be outside of it */
+#define SWEEP_EPSILON 0.001
+/* Side of a cell of the collision grid */
+#define GRID_CELL (BLOCK_SIZE * 4)
+
 static size_t stage_height = MAX_STAGE_HEIGHT;
 static size_t stage_length = MAX_STAGE_LENGTH;
 
 static bool split_screen = true;
 
 struct Region {
-	cairo_surface_t *t;
+	int tile;
 	struct game_Rect rect;
 };
 
+/* Levels are indexed at startup by their file only, and parsed the first
+ * time they're played. lock guards loading and unloading, which may
+ * happen on a pool thread while another level is played. */
 struct Level {
+	char *path;
+	time_t mtime;
+	off_t size;
+	pthread_mutex_t lock;
+	bool loaded;
+	/* The compiled level the arrays point into, if it was mapped or comes
+	 * from the pack */
+	void *map;
+	size_t map_len;
+	bool packed;
+
 	size_t stage_length;
 	struct Region *regions;
 	size_t regions_len;
 
+	/* Indices of the regions sorted by x, laid out as an implicit interval
+	 * tree: the root of by_x[lo..hi) is at (lo + hi) / 2 and max_end holds
+	 * the largest right edge of any region in the subtree under it. */
+	int *by_x;
+	int *max_end;
+
+	/* Uniform grid over the regions for collision. Cell c lists the
+	 * regions touching it in items[start[c]..start[c + 1]), in file order.
+	 * stamp marks regions already tested by the current query. */
+	struct {
+		int x;
+		int y;
+		int cols;
+		int rows;
+		int *start;
+		int *items;
+		unsigned *stamp;
+		unsigned clock;
+	} grid;
+
 	struct game_V2 end;
+
+	/* Where enemies are spawned when the level starts */
+	struct game_V2 *enemies;
+	size_t enemies_len;
+};
+
+/* A string rendered once with the game font, reused while it's drawn with
+ * the same size and color. */
+struct CachedText {
+	char text[TEXT_MAX_LEN];
+	int size;
+	struct game_Color color;
+
+	cairo_surface_t *surf;
+	/* Position and size of the surface relative to the start of the
+	 * baseline */
+	int x;
+	int y;
+	int w;
+	int h;
+	cairo_text_extents_t ext;
+
+	unsigned long used;
 };
 
 enum GameState {
@@ -67,19 +156,11 @@ enum GameState {
 };
 
 struct Player {
-	cairo_surface_t *frame[FRAME_NUM];
-	cairo_surface_t **current;
+	/* Which of the player's frames is shown */
+	int current;
 
-
-	struct {
-		bool active;
-		bool retToPlayer;
-		double x;
-		double y;
-		double initial_x;
-		double dx;
-		double dy;
-	} proj;
+	/* Seconds until the player can shoot again */
+	double cooldown;
 
 	struct {
 		double x;
@@ -87,6 +168,12 @@ struct Player {
 		double dx;
 		double dy;
 		struct game_Color color;
+
+		/* Ring buffer of the last positions of the trail, hist_head is
+		 * the index of the newest one. */
+		double hist_x[TRAIL_LEN];
+		double hist_y[TRAIL_LEN];
+		int hist_head;
 	} trail;
 
 	double x;
@@ -96,7 +183,35 @@ struct Player {
 	double w;
 	double h;
 
+	/* Position at the start of the last tick, and the one drawn this
+	 * frame, in between that and x, y. */
+	double prev_x;
+	double prev_y;
+	double draw_x;
+	double draw_y;
+
 	bool inAir;
+	bool jumpHigher;
+};
+
+/* Everything playing a level changes besides the entities. It's plain
+ * data, so saving and restoring it is a copy. */
+struct Sim {
+	/* Ticks since the level started */
+	long ticks;
+	struct Player player[MAX_PLAYERS];
+};
+
+/* A copy of the state of a level in play */
+struct Snapshot {
+	bool valid;
+	int level;
+	int numplayers;
+	struct Sim sim;
+	double cam_x[MAX_PLAYERS];
+	double cam_y[MAX_PLAYERS];
+	struct Entities entities;
+	struct Entities projectiles;
 };
 
 struct Game {
@@ -105,6 +220,23 @@ struct Game {
 	FT_Face    ft_face;
 	cairo_font_face_t *font_face;
 
+	struct Atlas atlas;
+	struct Assets assets;
+	/* GAME_DATA_DIR/PACK_FILE, if there is one */
+	struct Pack pack;
+	/* Handles to the images added to the atlas, held until it's built */
+	int *atlasAssets;
+	int atlasAssets_len;
+	/* Atlas textures of the frames of each player */
+	int playerFrames[MAX_PLAYERS][FRAME_NUM];
+
+	struct {
+		struct CachedText entries[TEXT_CACHE_SIZE];
+		unsigned long clock;
+		int w;
+		int h;
+	} text;
+
 	enum GameState state;
 
 	bool focusSelect;
@@ -113,6 +245,24 @@ struct Game {
 
 	double dt;
 
+	/* The simulation advances in ticks of a fixed length. accumulator
+	 * holds the time not simulated yet and alpha how far into the next
+	 * tick the frame being drawn is. */
+	int tickRate;
+	double tick;
+	double accumulator;
+	double alpha;
+
+	/* The input of every level started from the menu is recorded to
+	 * recordPath, if it's set. */
+	char *recordPath;
+	struct Replay record;
+
+	/* Keys held down, and keys pressed since the last tick so that short
+	 * taps aren't lost between ticks. */
+	bool held[MAX_PLAYERS][KEY_COUNT];
+	bool tapped[MAX_PLAYERS][KEY_COUNT];
+
 	int h;
 	int w;
 
@@ -125,7 +275,22 @@ struct Game {
 		double cam_y;
 	} screens[MAX_PLAYERS];
 
+	/* Multiple of LOGICAL_WIDTH x LOGICAL_HEIGHT the game is drawn at,
+	 * 0 to draw at the size of the window. */
 	double scale;
+	/* Bumped by game_NewTarget each time the platform replaces the
+	 * framebuffer, a new one can have the address of the old one */
+	unsigned int target;
+	/* Where the scaled game is drawn in the framebuffer, the rest of it is
+	 * black. full is set when the bars were painted this frame. */
+	struct {
+		unsigned int target;
+		int w;
+		int h;
+		int x;
+		int y;
+		bool full;
+	} box;
 	int numplayers;
 	int level;
 
@@ -133,85 +298,344 @@ struct Game {
 	int curLevel;
 	struct Level *levels;
 	int levels_len;
+	/* Parsing of the level after the one being played */
+	struct pool_Group prefetch;
+	/* The only level prefetches may touch, queued prefetches of other
+	 * levels are skipped */
+	atomic_int prefetchTarget;
+
+	/* Static tiles of the current level, baked into CHUNK_SIZE squares.
+	 * Chunks without any tiles in them are NULL. */
+	struct {
+		cairo_surface_t **surf;
+		bool *opaque;
+		bool *baked; /* per column */
+		/* Scratch space for the regions overlapping a column, allocated
+		 * once per level so baking a column stays O(log n + k) */
+		int *hits;
+		int x;
+		int y;
+		int cols;
+		int rows;
+		struct Level *level;
+	} chunks;
+
+	struct Entities entities;
+	struct Entities projectiles;
+	/* The level as it was when it started, and as it was when it was
+	 * last quick saved */
+	struct Snapshot start;
+	struct Snapshot quick;
+	/* Players and enemies sorted by x for finding the ones that touch,
+	 * and the pairs of them that may touch this tick. */
+	struct {
+		struct Body *bodies;
+		int len;
+		int (*pairs)[2];
+		size_t pairs_len;
+		size_t pairs_cap;
+	} broad;
+	/* Live enemies sorted by x, rebuilt every tick projectiles are
+	 * flying to find the ones a projectile may hit. */
+	struct {
+		int *ids;
+		int len;
+	} enemyIndex;
+
+	/* Regions of the screen that have to be repainted this frame */
+	struct game_Damage damage;
+
+	/* What was on the screen after the last frame, used to figure out
+	 * which parts of it need to be repainted. */
+	struct {
+		bool valid;
+		unsigned int target;
+		enum GameState state;
+		int menuFocus;
+		int numplayers;
+		int curLevel;
+		int deathAlpha;
+		int w;
+		int h;
+		double cam_x[MAX_PLAYERS];
+		double cam_y[MAX_PLAYERS];
+		struct game_Damage dynamic;
+	} drawn;
 
 	bool running;
+	/* Running without a window, textures or fonts */
+	bool headless;
 };
 
 static struct Game game;
-static struct Player player[MAX_PLAYERS];
+static struct Sim sim;
+static struct Player *const player = sim.player;
+
+/* A box taking part in collisions between players and enemies */
+struct Body {
+	float x;
+	float y;
+	float w;
+	float h;
+	/* Player number, or MAX_PLAYERS plus the entity slot */
+	int id;
+};
+
+/* Trail gradients rendered once for each size and color. Viewports are
+ * drawn on several threads, so access is guarded by a lock. */
+static struct {
+	pthread_mutex_t lock;
+	struct {
+		int size;
+		struct game_Color color;
+		cairo_surface_t *surf;
+	} entries[TRAIL_CACHE_SIZE];
+	int len;
+} trailCache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
 struct TileTexture {
 	char *name;
 
-	cairo_surface_t *tile;
+	int tile;
 };
 
 enum Tile {
 	TILE_SNOW,
+	TILE_COUNT,
 };
 
 static struct TileTexture tileTextures[] = {
-	[TILE_SNOW] = {"snow", NULL},
+	[TILE_SNOW] = {"snow", -1},
 };
 
-static cairo_surface_t *endPointTexture = NULL;
+static int endPointTexture = -1;
+static int enemyTexture = -1;
+
+static bool
+isOpaque(cairo_surface_t *surf)
+{
+	if (cairo_image_surface_get_format(surf) == CAIRO_FORMAT_RGB24)
+		return true;
+	if (cairo_image_surface_get_format(surf) != CAIRO_FORMAT_ARGB32)
+		return false;
+
+	cairo_surface_flush(surf);
+	uint8_t *data = cairo_image_surface_get_data(surf);
+	int stride = cairo_image_surface_get_stride(surf);
+	int w = cairo_image_surface_get_width(surf);
+	int h = cairo_image_surface_get_height(surf);
+	for (int y = 0; y < h; y++) {
+		uint32_t *row = (uint32_t *)(data + y * stride);
+		for (int x = 0; x < w; x++) {
+			if ((row[x] >> 24) != 0xFF)
+				return false;
+		}
+	}
+	return true;
+}
+
+/* Scale of the surfaces the game draws on */
+static double
+pixelScale(void)
+{
+	return game.scale > 0 ? game.scale : 1;
+}
+
+/* Returns an ARGB32 surface of w x h in the units the game draws in, with
+ * as many pixels as it covers at the scale it's drawn at, so it's drawn
+ * without being stretched */
+static cairo_surface_t *
+createSurface(int w, int h)
+{
+	double s = pixelScale();
+	cairo_surface_t *surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+			ceil(w * s), ceil(h * s));
+	cairo_surface_set_device_scale(surf, s, s);
+	return surf;
+}
+
+static cairo_surface_t *
+convertSurface(cairo_surface_t *surf, cairo_format_t format)
+{
+	cairo_surface_t *conv = cairo_image_surface_create(format,
+			cairo_image_surface_get_width(surf),
+			cairo_image_surface_get_height(surf));
+	cairo_t *cr = cairo_create(conv);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_surface(cr, surf, 0, 0);
+	cairo_paint(cr);
+	cairo_destroy(cr);
+	cairo_surface_flush(conv);
+	cairo_surface_destroy(surf);
+	return conv;
+}
 
+/* PNGs are decoded into whatever format fits their pixel type. Textures are
+ * converted to RGB24 when they don't have any transparent pixels, so they
+ * can be copied instead of blended, and to ARGB32 otherwise. */
 cairo_surface_t *
 loadCairoSurface(char *file)
 {
 	cairo_surface_t *surf =  cairo_image_surface_create_from_png(file);
 	cairo_status_t s = cairo_surface_status(surf);
 	if (s != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(surf);
 		return NULL;
 	}
+
+	cairo_format_t format = cairo_image_surface_get_format(surf);
+	if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24)
+		surf = convertSurface(surf, CAIRO_FORMAT_ARGB32);
+	if (cairo_image_surface_get_format(surf) == CAIRO_FORMAT_ARGB32 &&
+			isOpaque(surf)) {
+		surf = convertSurface(surf, CAIRO_FORMAT_RGB24);
+	}
 	return surf;
 }
 
+/* The entry for the file at path in the pack, or NULL if it isn't in it.
+ * Entries for files that changed since they were packed are left out, the
+ * entry is used if the file is gone. */
+static const struct pack_Entry *
+packEntry(char *path)
+{
+	size_t len = strlen(GAME_DATA_DIR);
+	if (game.pack.map == NULL || strncmp(path, GAME_DATA_DIR, len) != 0)
+		return NULL;
+	char *name = path + len;
+	name += strspn(name, "/");
+	const struct pack_Entry *e = pack_Find(&game.pack, name);
+	struct stat st;
+	if (e != NULL && stat(path, &st) == 0 &&
+			(st.st_mtime != e->mtime || st.st_size != e->source_size))
+		return NULL;
+	return e;
+}
+
+/* Whether e holds pixels cairo can draw from without reading past them */
+static bool
+packImageValid(const struct pack_Entry *e)
+{
+	return e->kind == PACK_IMAGE &&
+		(e->format == CAIRO_FORMAT_ARGB32 || e->format == CAIRO_FORMAT_RGB24) &&
+		e->width > 0 && e->height > 0 &&
+		e->stride % 4 == 0 && (int64_t)e->stride >= (int64_t)e->width * 4 &&
+		(uint64_t)e->stride * e->height <= e->size;
+}
+
+/* Images in the pack are cached by their name in it, other images by the
+ * path of their file. Broken entries are read from the file instead. */
+static bool
+resolveImage(char *path, char *key)
+{
+	const struct pack_Entry *e = packEntry(path);
+	if (e != NULL && packImageValid(e) &&
+			snprintf(key, PATH_MAX, "pack:%s", e->name) < PATH_MAX)
+		return true;
+	return realpath(path, key) != NULL;
+}
+
+/* Images in the pack are drawn from where it's mapped */
+static cairo_surface_t *
+loadImage(char *key)
+{
+	if (strncmp(key, "pack:", 5) != 0)
+		return loadCairoSurface(key);
+
+	const struct pack_Entry *e = pack_Find(&game.pack, key + 5);
+	if (e == NULL || !packImageValid(e))
+		return NULL;
+	cairo_surface_t *surf = cairo_image_surface_create_for_data(
+			pack_Data(&game.pack, e), e->format, e->width, e->height,
+			e->stride);
+	if (cairo_surface_status(surf) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(surf);
+		return NULL;
+	}
+	return surf;
+}
+
+/* Adds the first of the n images in paths that loads to the atlas, returns
+ * its id or -1. Images used more than once are only added once. */
+static int
+atlasImage(char **paths, int n)
+{
+	int h = asset_LoadFirst(&game.assets, paths, n);
+	if (h < 0)
+		return -1;
+	game.atlasAssets = erealloc(game.atlasAssets,
+			(game.atlasAssets_len + 1) * sizeof(*game.atlasAssets));
+	game.atlasAssets[game.atlasAssets_len++] = h;
+	return atlas_Add(&game.atlas,
+			cairo_surface_reference(asset_Surface(&game.assets, h)));
+}
+
+/* Builds the atlas and frees the images that went into it. The cache only
+ * saves decoding images shared while the atlas is built, like the first
+ * player's sprites that players without their own fall back to, so they
+ * aren't kept around as copies of what's in the atlas. */
+static bool
+buildAtlas(void)
+{
+	bool ok = atlas_Build(&game.atlas);
+	for (int i = 0; i < game.atlasAssets_len; i++)
+		asset_Release(&game.assets, game.atlasAssets[i]);
+	asset_Purge(&game.assets);
+	free(game.atlasAssets);
+	game.atlasAssets = NULL;
+	game.atlasAssets_len = 0;
+	return ok;
+}
+
+static bool
+tilePath(char *file, char *name)
+{
+	if (snprintf(file, PATH_MAX, "%s/tiles/%s.png",
+				GAME_DATA_DIR, name) >= PATH_MAX) {
+		fprintf(stderr, "path to tile %s is too long\n", name);
+		return false;
+	}
+	return true;
+}
+
+/* Adds the image of tile name to the atlas, returns its id or -1 */
+static int
+loadTile(char *name)
+{
+	char file[PATH_MAX];
+	if (!tilePath(file, name))
+		return -1;
+	char *paths[] = {file};
+	int id = atlasImage(paths, 1);
+	if (id < 0)
+		fprintf(stderr, "can't load tile %s from file %s\n", name, file);
+	return id;
+}
+
 void
 initTileTextures(void)
 {
-	char *tileDir = GAME_DATA_DIR"/tiles/";
-	int tileDirLen = strlen(tileDir);
-	char *ext = ".png";
-	int extLen = strlen(ext);
-	char file[PATH_MAX];
 	for (size_t i = 0; i < (sizeof(tileTextures) / sizeof(tileTextures[0])); i++) {
 		struct TileTexture *t = &tileTextures[i];
-		int nameLen = strlen(t->name);
-		memcpy(file, tileDir, tileDirLen);
-		memcpy(file + tileDirLen, t->name, nameLen);
-		memcpy(file + tileDirLen + nameLen, ext, extLen);
-		*(file + tileDirLen + nameLen + extLen) = 0;
-		t->tile = loadCairoSurface(file);
-		if (t->tile == NULL) {
-			fprintf(stderr, "can't load tile %s from file %s\n", t->name, file);
-			continue;
-		}
+		t->tile = loadTile(t->name);
 	}
 
-	char *name = "end";
-	int nameLen = strlen(name);
-
-	memcpy(file, tileDir, tileDirLen);
-	memcpy(file + tileDirLen, name, nameLen);
-	memcpy(file + tileDirLen + nameLen, ext, extLen);
-	*(file + tileDirLen + nameLen + extLen) = 0;
-	endPointTexture = loadCairoSurface(file);
-	if (endPointTexture == NULL) {
-		fprintf(stderr, "can't load tile %s from file %s\n", name, file);
-	}
+	endPointTexture = loadTile("end");
+	enemyTexture = loadTile("enemy");
 }
 
-cairo_surface_t *
-getTileTexture(char *s)
+int
+getTile(char *s)
 {
 	for (size_t i = 0; i < sizeof(tileTextures) / sizeof(tileTextures[0]); i++) {
 		struct TileTexture *t = &tileTextures[i];
 		if (strcmp(t->name, s) == 0) {
-			return t->tile;
+			return i;
 		}
 	}
-	return NULL;
+	return -1;
 }
 
 bool
@@ -230,46 +654,107 @@ formatPath(char *path, char *resPath, int i, int frame)
 	};
 }
 
+/* Player sprites are looked for in the user's data directory, then the
+ * game's, and players without sprites of their own use the first
+ * player's. The paths are written to buf, paths[0] is NULL if there's no
+ * user directory. */
 static void
-loadPlayerImages(int i)
+playerPaths(int i, int frame, char buf[PLAYER_PATHS][PATH_MAX],
+		char *paths[PLAYER_PATHS])
 {
 	char *userDir = getenv("XDG_DATA_HOME");
-	char path[PATH_MAX];
+	paths[0] = NULL;
+	if (userDir != NULL) {
+		formatPath(buf[0], userDir, i, frame);
+		paths[0] = buf[0];
+	}
+	formatPath(buf[1], GAME_DATA_DIR, i, frame);
+	formatPath(buf[2], GAME_DATA_DIR, 0, frame);
+	paths[1] = buf[1];
+	paths[2] = buf[2];
+}
+
+static void
+loadPlayerImages(int i)
+{
 	for (int frame = 0; frame < FRAME_NUM; frame++) {
-		formatPath(path, userDir, i, frame);
+		char buf[PLAYER_PATHS][PATH_MAX];
+		char *paths[PLAYER_PATHS];
+		playerPaths(i, frame, buf, paths);
 
-		player[i].frame[frame] = loadCairoSurface(path);
+		game.playerFrames[i][frame] = atlasImage(paths, PLAYER_PATHS);
+		if (game.playerFrames[i][frame] < 0)
+			fprintf(stderr, "Unable to load image texture: %s\n", paths[1]);
+	}
+}
 
-		if (player[i].frame[frame] == NULL) {
-			formatPath(path, GAME_DATA_DIR, i, frame);
-			player[i].frame[frame] = loadCairoSurface(path);
+/* Starts decoding every image the atlas is built from as jobs of group */
+static void
+prefetchImages(struct pool_Group *group)
+{
+	enum {
+		TILE_IMAGES = sizeof(tileTextures) / sizeof(tileTextures[0]) + 2,
+		PLAYER_IMAGES = MAX_PLAYERS * FRAME_NUM * PLAYER_PATHS,
+	};
+	static char buf[TILE_IMAGES + PLAYER_IMAGES][PATH_MAX];
+	char *paths[TILE_IMAGES + PLAYER_IMAGES];
+	int n = 0;
+
+	char *tiles[TILE_IMAGES];
+	for (size_t i = 0; i < TILE_IMAGES - 2; i++)
+		tiles[i] = tileTextures[i].name;
+	tiles[TILE_IMAGES - 2] = "end";
+	tiles[TILE_IMAGES - 1] = "enemy";
+	for (int i = 0; i < TILE_IMAGES; i++) {
+		if (tilePath(buf[n], tiles[i])) {
+			paths[n] = buf[n];
+			n++;
+		}
+	}
 
-			if (player[i].frame[frame] == NULL) {
-				fprintf(stderr, "Unable to load image texture: %s\n", path);
+	char (*next)[PATH_MAX] = &buf[TILE_IMAGES];
+	for (int i = 0; i < MAX_PLAYERS; i++) {
+		for (int frame = 0; frame < FRAME_NUM; frame++) {
+			char *p[PLAYER_PATHS];
+			playerPaths(i, frame, next, p);
+			next += PLAYER_PATHS;
+			/* Only the image loadPlayerImages will pick */
+			for (int j = 0; j < PLAYER_PATHS; j++) {
+				char key[PATH_MAX];
+				if (p[j] != NULL && resolveImage(p[j], key)) {
+					paths[n++] = p[j];
+					break;
+				}
 			}
 		}
 	}
+	asset_Prefetch(&game.assets, paths, n, group);
 }
 
+/* Lays the viewports out in a grid as close to square as possible, the
+ * viewports of a last row that isn't full are stretched to fill it. */
 static void
 resize_screens(int width, int height)
 {
-	// TODO: account for game.numplayers being a number other than 2.
-	game.screens[0].x = 0;
-	game.screens[0].y = 0;
-	game.screens[0].w = width;
-	game.screens[0].h = height;
-	if (game.numplayers == 1) {
-		game.screens[0].w = width/2;
+	int n = game.numplayers + 1;
+	int cols = 1;
+	while (cols * cols < n)
+		cols++;
+	int rows = (n + cols - 1) / cols;
+
+	for (int i = 0; i < n; i++) {
+		int row = i / cols;
+		int col = i % cols;
+		int inRow = row == rows - 1 ? n - row * cols : cols;
+		game.screens[i].x = width * col / inRow;
+		game.screens[i].y = height * row / rows;
+		game.screens[i].w = width * (col + 1) / inRow - game.screens[i].x;
+		game.screens[i].h = height * (row + 1) / rows - game.screens[i].y;
 	}
-	game.screens[1].x = width/2;
-	game.screens[1].y = 0;
-	game.screens[1].w = width/2;
-	game.screens[1].h = height;
 }
 
 static void
-loadPlayerTextures(void)
+resetPlayers(void)
 {
 	for (int i = 0; i <= game.numplayers; i++) {
 		game.screens[i].cam_x = 0;
@@ -279,22 +764,28 @@ loadPlayerTextures(void)
 	resize_screens(LOGICAL_WIDTH, LOGICAL_HEIGHT);
 
 	for (int i = 0; i <= game.numplayers; i++) {
-		loadPlayerImages(i);
-
-		player[i].current = &player[i].frame[0];
+		player[i].current = 0;
 
 		player[i].x  = 0;
 		player[i].y  = 0;
 		player[i].dx = 0;
 		player[i].dy = 0;
+		player[i].inAir = false;
+		player[i].jumpHigher = false;
+		player[i].prev_x = player[i].draw_x = 0;
+		player[i].prev_y = player[i].draw_y = 0;
 
-		player[i].proj.x = -1;
-		player[i].proj.y = -1;
+		player[i].cooldown = 0;
 
 		player[i].trail.x = 0;
 		player[i].trail.y = 0;
 		player[i].trail.dx = 0;
 		player[i].trail.dy = 0;
+		for (int k = 0; k < TRAIL_LEN; k++) {
+			player[i].trail.hist_x[k] = 0;
+			player[i].trail.hist_y[k] = 0;
+		}
+		player[i].trail.hist_head = 0;
 		player[i].trail.color = (struct game_Color){
 			.r = 0x11,
 			.g = 0x0F,
@@ -307,33 +798,234 @@ loadPlayerTextures(void)
 	}
 }
 
+/* Levels may be parsed on several threads at once */
+static _Thread_local struct Level *sortLevel;
+
+static int
+compareRegionX(const void *a, const void *b)
+{
+	int i = *(const int *)a;
+	int j = *(const int *)b;
+	int x0 = sortLevel->regions[i].rect.x;
+	int x1 = sortLevel->regions[j].rect.x;
+	if (x0 != x1)
+		return x0 < x1 ? -1 : 1;
+	return i - j;
+}
+
+static int
+buildIntervals(struct Level *level, int lo, int hi)
+{
+	if (lo >= hi)
+		return INT_MIN;
+	int mid = lo + (hi - lo) / 2;
+	struct game_Rect r = level->regions[level->by_x[mid]].rect;
+	int end = r.x + r.w;
+	int left = buildIntervals(level, lo, mid);
+	int right = buildIntervals(level, mid + 1, hi);
+	if (left > end) end = left;
+	if (right > end) end = right;
+	level->max_end[mid] = end;
+	return end;
+}
+
 static void
-freePlayerTextures(void)
+indexLevel(struct Level *level)
 {
-	for (int i = 0; i < MAX_PLAYERS; i++) {
-		for (int frame = 0; frame < FRAME_NUM; frame++) {
-			if (player[i].frame[frame])
-				cairo_surface_destroy(player[i].frame[frame]);
-			player[i].frame[frame] = NULL;
+	level->by_x = ecalloc(level->regions_len, sizeof(*level->by_x));
+	level->max_end = ecalloc(level->regions_len, sizeof(*level->max_end));
+	for (size_t i = 0; i < level->regions_len; i++)
+		level->by_x[i] = i;
+	sortLevel = level;
+	qsort(level->by_x, level->regions_len, sizeof(*level->by_x), compareRegionX);
+	sortLevel = NULL;
+	buildIntervals(level, 0, level->regions_len);
+}
+
+/* Appends the indices of the regions overlapping [x0, x1) horizontally to
+ * out, in O(log n + k). */
+static void
+queryIntervals(struct Level *level, int lo, int hi, int x0, int x1,
+		int *out, int *len)
+{
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (level->max_end[mid] <= x0)
+			return;
+		queryIntervals(level, lo, mid, x0, x1, out, len);
+
+		struct game_Rect r = level->regions[level->by_x[mid]].rect;
+		/* Everything to the right starts at or after this one */
+		if (r.x >= x1)
+			return;
+		if (r.x + r.w > x0)
+			out[(*len)++] = level->by_x[mid];
+		lo = mid + 1;
+	}
+}
+
+/* Range of grid cells covering [a0, a1] along an axis starting at org
+ * with n cells */
+static void
+gridSpan(double a0, double a1, int org, int n, int *c0, int *c1)
+{
+	if (a1 < a0) {
+		double t = a0;
+		a0 = a1;
+		a1 = t;
+	}
+	*c0 = (int)floor((a0 - org) / GRID_CELL);
+	*c1 = (int)floor((a1 - org) / GRID_CELL);
+	if (*c0 < 0) *c0 = 0;
+	if (*c1 >= n) *c1 = n - 1;
+}
+
+static void
+gridLevel(struct Level *level)
+{
+	int x0 = INT_MAX, y0 = INT_MAX;
+	int x1 = INT_MIN, y1 = INT_MIN;
+	for (size_t i = 0; i < level->regions_len; i++) {
+		struct game_Rect r = level->regions[i].rect;
+		if (r.x < x0) x0 = r.x;
+		if (r.y < y0) y0 = r.y;
+		if (r.x + r.w > x1) x1 = r.x + r.w;
+		if (r.y + r.h > y1) y1 = r.y + r.h;
+	}
+	level->grid.x = x0;
+	level->grid.y = y0;
+	level->grid.cols = (x1 - x0) / GRID_CELL + 1;
+	level->grid.rows = (y1 - y0) / GRID_CELL + 1;
+	int ncells = level->grid.cols * level->grid.rows;
+	level->grid.start = ecalloc(ncells + 1, sizeof(*level->grid.start));
+	level->grid.stamp = ecalloc(level->regions_len, sizeof(*level->grid.stamp));
+	level->grid.clock = 0;
+
+	/* Count the regions in each cell, turn the counts into offsets and
+	 * fill the cells in a second pass. */
+	for (int pass = 0; pass < 2; pass++) {
+		int *fill = NULL;
+		if (pass == 1) {
+			for (int c = 0; c < ncells; c++)
+				level->grid.start[c + 1] += level->grid.start[c];
+			level->grid.items = ecalloc(level->grid.start[ncells] + 1,
+					sizeof(*level->grid.items));
+			fill = ecalloc(ncells, sizeof(*fill));
+		}
+		for (size_t i = 0; i < level->regions_len; i++) {
+			struct game_Rect r = level->regions[i].rect;
+			int c0, c1, r0, r1;
+			gridSpan(r.x, r.x + r.w - 1, x0, level->grid.cols, &c0, &c1);
+			gridSpan(r.y, r.y + r.h - 1, y0, level->grid.rows, &r0, &r1);
+			for (int row = r0; row <= r1; row++) {
+				for (int col = c0; col <= c1; col++) {
+					int c = row * level->grid.cols + col;
+					if (pass == 0)
+						level->grid.start[c + 1]++;
+					else
+						level->grid.items[level->grid.start[c] + fill[c]++] = i;
+				}
+			}
+		}
+		free(fill);
+	}
+}
+
+/*
+ * Sweeps the box at x, y of size w, h by d along the x axis, or the y axis
+ * if vertical is set, against the regions in the grid cells it passes
+ * through. Returns the region it touches first, or NULL if it can move the
+ * whole way. Regions the box already overlaps are ignored so it can get
+ * out of them.
+ */
+static struct Region *
+sweepRegions(struct Level *level, double x, double y, double w, double h,
+		bool vertical, double d)
+{
+	if (level->grid.start == NULL || d == 0)
+		return NULL;
+	if (++level->grid.clock == 0) {
+		memset(level->grid.stamp, 0,
+				level->regions_len * sizeof(*level->grid.stamp));
+		level->grid.clock = 1;
+	}
+
+	/* Work along the axis of movement as if it was x */
+	double pos = vertical ? y : x;
+	double size = vertical ? h : w;
+	double side = vertical ? x : y;
+	double sideSize = vertical ? w : h;
+
+	int c0, c1, r0, r1;
+	if (vertical) {
+		gridSpan(x, x + w, level->grid.x, level->grid.cols, &c0, &c1);
+		gridSpan(fmin(y, y + d), fmax(y + h, y + h + d),
+				level->grid.y, level->grid.rows, &r0, &r1);
+	} else {
+		gridSpan(fmin(x, x + d), fmax(x + w, x + w + d),
+				level->grid.x, level->grid.cols, &c0, &c1);
+		gridSpan(y, y + h, level->grid.y, level->grid.rows, &r0, &r1);
+	}
+
+	struct Region *hit = NULL;
+	double first = 1;
+	for (int row = r0; row <= r1; row++) {
+		for (int col = c0; col <= c1; col++) {
+			int c = row * level->grid.cols + col;
+			for (int k = level->grid.start[c]; k < level->grid.start[c + 1]; k++) {
+				int i = level->grid.items[k];
+				if (level->grid.stamp[i] == level->grid.clock)
+					continue;
+				level->grid.stamp[i] = level->grid.clock;
+
+				struct game_Rect rect = level->regions[i].rect;
+				double rpos = vertical ? rect.y : rect.x;
+				double rsize = vertical ? rect.h : rect.w;
+				double rside = vertical ? rect.x : rect.y;
+				double rsideSize = vertical ? rect.w : rect.h;
+				if (side >= rside + rsideSize || side + sideSize <= rside)
+					continue;
+
+				/* Time of impact as a fraction of d */
+				double t;
+				if (d > 0) {
+					if (rpos < pos + size - SWEEP_EPSILON)
+						continue;
+					t = (rpos - (pos + size)) / d;
+				} else {
+					if (rpos + rsize > pos + SWEEP_EPSILON)
+						continue;
+					t = (rpos + rsize - pos) / d;
+				}
+				if (t < 0)
+					t = 0;
+				/* Ties go to the region first in the level file */
+				if (t < first || (t == first && hit != NULL &&
+						&level->regions[i] < hit)) {
+					first = t;
+					hit = &level->regions[i];
+				}
+			}
 		}
 	}
+	return first < 1 ? hit : NULL;
 }
 
-static struct Level
-loadLevel(char *file)
+/* Parses the level file into level, returns false if it has no tiles */
+static bool
+loadLevel(struct Level *level, char *file)
 {
-	struct Level level = {0};
 	struct scfg_block block;
 	if (scfg_load_file(&block, file) < 0) {
 		fprintf(stderr, "Failed to load file %s\n", file);
-		return level;
+		return false;
 	}
 
-	level.regions = ecalloc(block.directives_len, sizeof(struct Region));
-	level.regions_len = 0;
-	level.end.x = -1;
-	level.end.y = -1;
-	level.stage_length = MAX_STAGE_LENGTH;
+	level->regions = ecalloc(block.directives_len, sizeof(struct Region));
+	level->regions_len = 0;
+	level->end.x = -1;
+	level->end.y = -1;
+	level->stage_length = MAX_STAGE_LENGTH;
 	for (size_t i = 0; i < block.directives_len; ++i) {
 		if (strcmp(block.directives[i].name, "stage_length") == 0) {
 			if (block.directives[i].params_len != 1) {
@@ -342,11 +1034,11 @@ loadLevel(char *file)
 						block.directives[i].lineno,
 						(int)block.directives[i].params_len);
 			}
-			level.stage_length = atoi(block.directives[i].params[0]);
-			if (level.stage_length <= 0 || level.stage_length > MAX_STAGE_LENGTH)
-				level.stage_length = MAX_STAGE_LENGTH;
+			level->stage_length = atoi(block.directives[i].params[0]);
+			if (level->stage_length <= 0 || level->stage_length > MAX_STAGE_LENGTH)
+				level->stage_length = MAX_STAGE_LENGTH;
 			else
-				level.stage_length *= BLOCK_SIZE;
+				level->stage_length *= BLOCK_SIZE;
 			continue;
 		} else if (strcmp(block.directives[i].name, "end") == 0) {
 			if (block.directives[i].params_len != 2) {
@@ -355,11 +1047,23 @@ loadLevel(char *file)
 						block.directives[i].lineno,
 						(int)block.directives[i].params_len);
 			}
-			level.end.x = atoi(block.directives[i].params[0]) * BLOCK_SIZE;
-			level.end.y = atoi(block.directives[i].params[1]) * BLOCK_SIZE;
+			level->end.x = atoi(block.directives[i].params[0]) * BLOCK_SIZE;
+			level->end.y = atoi(block.directives[i].params[1]) * BLOCK_SIZE;
 			continue;
 		} else if (strcmp(block.directives[i].name, "enemy") == 0) {
-			// TODO:
+			if (block.directives[i].params_len != 2) {
+				fprintf(stderr, "%s:%d Expected 2 field for enemy got %d\n",
+						file,
+						block.directives[i].lineno,
+						(int)block.directives[i].params_len);
+				continue;
+			}
+			level->enemies = erealloc(level->enemies,
+					(level->enemies_len + 1) * sizeof(*level->enemies));
+			level->enemies[level->enemies_len++] = (struct game_V2){
+				.x = atoi(block.directives[i].params[0]) * BLOCK_SIZE,
+				.y = atoi(block.directives[i].params[1]) * BLOCK_SIZE,
+			};
 			continue;
 		}
 
@@ -371,8 +1075,8 @@ loadLevel(char *file)
 			continue;
 		};
 
-		cairo_surface_t *t = getTileTexture(block.directives[i].name);
-		if (t == NULL) {
+		int t = getTile(block.directives[i].name);
+		if (t < 0) {
 			fprintf(stderr, "%s:%d: unknown tile %s\n", file,
 					block.directives[i].lineno,
 					block.directives[i].name);
@@ -385,8 +1089,8 @@ loadLevel(char *file)
 		coords[2] = atoi(block.directives[i].params[2]) * BLOCK_SIZE;
 		coords[3] = atoi(block.directives[i].params[3]) * BLOCK_SIZE;
 
-		level.regions[level.regions_len] = (struct Region){
-			.t = t,
+		level->regions[level->regions_len] = (struct Region){
+			.tile = t,
 				.rect = (struct game_Rect){
 					coords[0],
 					coords[1],
@@ -394,61 +1098,626 @@ loadLevel(char *file)
 					coords[3],
 				},
 		};
-		level.regions_len++;
+		level->regions_len++;
 	}
 
-	if (level.end.x < 0 || level.end.y < 0) {
+	if (level->end.x < 0 || level->end.y < 0) {
 		// XXX: what should we do in this case?
 	}
 
-	stage_length = level.stage_length;
-	if (level.regions_len == 0) {
+	scfg_block_finish(&block);
+	if (level->regions_len == 0) {
 		fprintf(stderr, "Unable to read any data from file %s\n", file);
-		free(level.regions);
+		return false;
 	}
-	scfg_block_finish(&block);
+	indexLevel(level);
+	gridLevel(level);
+	return true;
+}
+
+/* Frees what loadLevel allocated, keeping the index entry */
+static void
+unloadLevel(struct Level *level)
+{
+	if (level->packed) {
+		/* The arrays are in the pack, which stays mapped */
+	} else if (level->map != NULL) {
+		munmap(level->map, level->map_len);
+		level->map = NULL;
+		level->map_len = 0;
+	} else {
+		free(level->regions);
+		free(level->by_x);
+		free(level->max_end);
+		free(level->grid.start);
+		free(level->grid.items);
+		free(level->enemies);
+	}
+	free(level->grid.stamp);
+	level->regions = NULL;
+	level->regions_len = 0;
+	level->by_x = NULL;
+	level->max_end = NULL;
+	level->grid.start = NULL;
+	level->grid.items = NULL;
+	level->grid.stamp = NULL;
+	level->enemies = NULL;
+	level->enemies_len = 0;
+	level->loaded = false;
+}
+
+/*
+ * Compiled levels are written by game_CompileLevels next to the text file
+ * they come from, as <file>.lvl, and mapped into memory as they are. They
+ * hold everything loadLevel builds, in host byte order, each array at an
+ * offset from the start of the file that is a multiple of 8. A compiled
+ * level is only used when the text file has the mtime and size it was
+ * compiled from.
+ */
+#define LEVEL_MAGIC "FYLV"
+#define LEVEL_FORMAT 1
+#define LEVEL_ALIGN 8
+
+_Static_assert(sizeof(int) == 4, "compiled levels store ints as 4 bytes");
+
+struct LevelFile {
+	char magic[4];
+	uint32_t format;
+	/* Number of tile kinds the tile ids were given against */
+	uint32_t tiles;
+	uint32_t stage_length;
+	int64_t mtime;
+	int64_t size;
+	int32_t end_x;
+	int32_t end_y;
+	uint32_t regions_len;
+	uint32_t enemies_len;
+	int32_t grid_x;
+	int32_t grid_y;
+	int32_t grid_cols;
+	int32_t grid_rows;
+	uint32_t items_len;
+
+	/* Offsets of the arrays */
+	uint32_t regions;  /* struct Region[regions_len] */
+	uint32_t by_x;     /* int[regions_len] */
+	uint32_t max_end;  /* int[regions_len] */
+	uint32_t start;    /* int[grid_cols * grid_rows + 1] */
+	uint32_t items;    /* int[items_len] */
+	uint32_t enemies;  /* struct game_V2[enemies_len] */
+};
+
+static void
+compiledPath(char *dst, size_t len, struct Level *level)
+{
+	if (snprintf(dst, len, "%s.lvl", level->path) >= (int)len)
+		dst[0] = '\0';
+}
+
+/* Whether the header h describes a compiled version of level's text */
+static bool
+levelFileFresh(const struct LevelFile *h, struct Level *level)
+{
+	return memcmp(h->magic, LEVEL_MAGIC, 4) == 0 &&
+		h->format == LEVEL_FORMAT &&
+		h->tiles == TILE_COUNT &&
+		h->mtime == (int64_t)level->mtime &&
+		h->size == (int64_t)level->size;
+}
+
+/* Whether n elements of size bytes at off fit in a file of len bytes */
+static bool
+arrayFits(uint64_t off, uint64_t n, size_t size, size_t len)
+{
+	return off % LEVEL_ALIGN == 0 && off <= len && n * size <= len - off;
+}
+
+/* Whether the arrays of the compiled level in map only hold tiles and
+ * indices that are in range, so nothing reads past them */
+static bool
+levelArraysValid(const struct LevelFile *h, const char *map, uint64_t ncells)
+{
+	const struct Region *regions = (const struct Region *)(map + h->regions);
+	const int *by_x = (const int *)(map + h->by_x);
+	const int *start = (const int *)(map + h->start);
+	const int *items = (const int *)(map + h->items);
+	for (uint32_t i = 0; i < h->regions_len; i++) {
+		if (regions[i].tile < 0 || regions[i].tile >= TILE_COUNT ||
+				by_x[i] < 0 || (uint32_t)by_x[i] >= h->regions_len)
+			return false;
+	}
+	if (start[0] < 0)
+		return false;
+	for (uint64_t c = 0; c < ncells; c++) {
+		if (start[c + 1] < start[c])
+			return false;
+	}
+	if ((uint32_t)start[ncells] > h->items_len)
+		return false;
+	for (uint32_t i = 0; i < h->items_len; i++) {
+		if (items[i] < 0 || (uint32_t)items[i] >= h->regions_len)
+			return false;
+	}
+	return true;
+}
+
+static bool useLevelFile(struct Level *level, char *map, size_t len);
+
+/* Points level at the arrays of its compiled file. Returns false if there
+ * is none or it's out of date. */
+static bool
+mapLevel(struct Level *level)
+{
+	char file[PATH_MAX];
+	compiledPath(file, sizeof(file), level);
+	int fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct LevelFile)) {
+		close(fd);
+		return false;
+	}
+	size_t len = st.st_size;
+	char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+	if (!useLevelFile(level, map, len)) {
+		munmap(map, len);
+		return false;
+	}
+	level->map = map;
+	level->map_len = len;
+	return true;
+}
+
+/* Points level at the arrays of the compiled level in map, returns false
+ * if it's out of date or broken */
+static bool
+useLevelFile(struct Level *level, char *map, size_t len)
+{
+	const struct LevelFile *h = (const struct LevelFile *)map;
+	uint64_t ncells = (uint64_t)(h->grid_cols > 0 ? h->grid_cols : 0) *
+		(uint64_t)(h->grid_rows > 0 ? h->grid_rows : 0);
+	if (!levelFileFresh(h, level))
+		return false;
+	if (h->regions_len == 0 || ncells == 0 || ncells > len ||
+			!arrayFits(h->regions, h->regions_len, sizeof(struct Region), len) ||
+			!arrayFits(h->by_x, h->regions_len, sizeof(int), len) ||
+			!arrayFits(h->max_end, h->regions_len, sizeof(int), len) ||
+			!arrayFits(h->start, ncells + 1, sizeof(int), len) ||
+			!arrayFits(h->items, h->items_len, sizeof(int), len) ||
+			!arrayFits(h->enemies, h->enemies_len, sizeof(struct game_V2), len) ||
+			!levelArraysValid(h, map, ncells)) {
+		fprintf(stderr, "compiled level %s is corrupt\n", level->path);
+		return false;
+	}
+
+	level->stage_length = h->stage_length;
+	level->end.x = h->end_x;
+	level->end.y = h->end_y;
+	level->regions = (struct Region *)(map + h->regions);
+	level->regions_len = h->regions_len;
+	level->by_x = (int *)(map + h->by_x);
+	level->max_end = (int *)(map + h->max_end);
+	level->grid.x = h->grid_x;
+	level->grid.y = h->grid_y;
+	level->grid.cols = h->grid_cols;
+	level->grid.rows = h->grid_rows;
+	level->grid.start = (int *)(map + h->start);
+	level->grid.items = (int *)(map + h->items);
+	level->grid.stamp = ecalloc(level->regions_len, sizeof(*level->grid.stamp));
+	level->grid.clock = 0;
+	level->enemies = (struct game_V2 *)(map + h->enemies);
+	level->enemies_len = h->enemies_len;
+	return true;
+}
+
+/* Writes n elements of size bytes padded to LEVEL_ALIGN, returns the
+ * offset they were written at */
+static uint32_t
+writeArray(FILE *f, const void *p, size_t n, size_t size)
+{
+	static const char pad[LEVEL_ALIGN];
+	long off = ftell(f);
+	fwrite(p, size, n, f);
+	size_t rem = (n * size) % LEVEL_ALIGN;
+	if (rem != 0)
+		fwrite(pad, 1, LEVEL_ALIGN - rem, f);
+	return off;
+}
+
+/* Writes the compiled version of a parsed level to f, which must be at
+ * the start of a file */
+static void
+writeLevelTo(FILE *f, struct Level *level)
+{
+	int ncells = level->grid.cols * level->grid.rows;
+	struct LevelFile h = {
+		.format = LEVEL_FORMAT,
+		.tiles = TILE_COUNT,
+		.stage_length = level->stage_length,
+		.mtime = level->mtime,
+		.size = level->size,
+		.end_x = level->end.x,
+		.end_y = level->end.y,
+		.regions_len = level->regions_len,
+		.enemies_len = level->enemies_len,
+		.grid_x = level->grid.x,
+		.grid_y = level->grid.y,
+		.grid_cols = level->grid.cols,
+		.grid_rows = level->grid.rows,
+		.items_len = level->grid.start[ncells],
+	};
+	memcpy(h.magic, LEVEL_MAGIC, 4);
+
+	writeArray(f, &h, 1, sizeof(h));
+	h.regions = writeArray(f, level->regions, level->regions_len,
+			sizeof(*level->regions));
+	h.by_x = writeArray(f, level->by_x, level->regions_len,
+			sizeof(*level->by_x));
+	h.max_end = writeArray(f, level->max_end, level->regions_len,
+			sizeof(*level->max_end));
+	h.start = writeArray(f, level->grid.start, ncells + 1,
+			sizeof(*level->grid.start));
+	h.items = writeArray(f, level->grid.items, h.items_len,
+			sizeof(*level->grid.items));
+	h.enemies = writeArray(f, level->enemies, level->enemies_len,
+			sizeof(*level->enemies));
+	rewind(f);
+	fwrite(&h, sizeof(h), 1, f);
+	fseek(f, 0, SEEK_END);
+}
+
+/* Writes the compiled version of a parsed level next to it. It's written
+ * to a temporary file first since the old one may be mapped. */
+static bool
+writeLevel(struct Level *level)
+{
+	char file[PATH_MAX], tmp[PATH_MAX];
+	compiledPath(file, sizeof(file), level);
+	if (file[0] == '\0' ||
+			snprintf(tmp, sizeof(tmp), "%s.tmp", file) >= (int)sizeof(tmp)) {
+		fprintf(stderr, "path to level %s is too long\n", level->path);
+		return false;
+	}
+	FILE *f = fopen(tmp, "wb");
+	if (f == NULL) {
+		perror(tmp);
+		return false;
+	}
+	writeLevelTo(f, level);
+
+	bool ok = !ferror(f);
+	if (fclose(f) != 0)
+		ok = false;
+	if (!ok || rename(tmp, file) < 0) {
+		perror(file);
+		remove(tmp);
+		return false;
+	}
+	return true;
+}
+
+/* Parses level if it isn't yet, or again if its file changed since. Must
+ * be called with level->lock held. */
+static void
+refreshLevel(struct Level *level)
+{
+	struct stat st;
+	if (stat(level->path, &st) == 0 &&
+			(st.st_mtime != level->mtime || st.st_size != level->size)) {
+		level->mtime = st.st_mtime;
+		level->size = st.st_size;
+		if (level->loaded)
+			unloadLevel(level);
+		/* The file changed since it was packed */
+		if (level->packed) {
+			level->packed = false;
+			level->map = NULL;
+			level->map_len = 0;
+		}
+	}
+	if (!level->loaded) {
+		/* A broken packed level is read from its file like any other */
+		if (level->packed && !useLevelFile(level, level->map, level->map_len)) {
+			level->packed = false;
+			level->map = NULL;
+			level->map_len = 0;
+		}
+		/* A level that fails stays failed until its file changes */
+		bool ok = level->packed || mapLevel(level) ||
+			loadLevel(level, level->path);
+		if (!ok)
+			unloadLevel(level);
+		level->loaded = true;
+	}
+}
+
+/* Parses level if it needs to be, returns false if it has no tiles */
+static bool
+ensureLevel(struct Level *level)
+{
+	pthread_mutex_lock(&level->lock);
+	refreshLevel(level);
+	bool ok = level->regions_len > 0;
+	pthread_mutex_unlock(&level->lock);
+	return ok;
+}
+
+/* Parses a level on the pool ahead of it being played. Prefetches left
+ * over from earlier levels are skipped, so only the current and next
+ * levels stay parsed and the level being played, which is read without
+ * its lock, is never unloaded from a worker. */
+static void
+prefetchLevel(void *arg)
+{
+	struct Level *level = arg;
+	pthread_mutex_lock(&level->lock);
+	if (level - game.levels == atomic_load(&game.prefetchTarget))
+		refreshLevel(level);
+	pthread_mutex_unlock(&level->lock);
+}
+
+struct FontJob {
+	char *file;
+	FT_Error err;
+};
 
-	return level;
+static void
+loadFontJob(void *arg)
+{
+	struct FontJob *job = arg;
+	const struct pack_Entry *font = packEntry(job->file);
+	if (font != NULL)
+		job->err = FT_New_Memory_Face(game.ft_lib,
+				pack_Data(&game.pack, font), font->size, 0, &game.ft_face);
+	else
+		job->err = FT_New_Face(game.ft_lib, job->file, 0, &game.ft_face);
 }
 
+/* Levels are used from the pack while their file is unchanged or gone,
+ * levels which aren't in it are read from their file */
 static void
-loadLevels(void)
+loadLevels(char *levelDir)
 {
 	struct Level *levels = NULL;
 	int levels_len = 0;
 	char path[PATH_MAX];
 
-	char *levelDir = GAME_DATA_DIR"/levels/";
 	size_t levelDirLen = strlen(levelDir);
 	memcpy(path, levelDir, levelDirLen);
 
 	// arbitrary limit of 400
 	for (int i = 1; i < 400; i++) {
 		size_t path_len = sizeof(path) - levelDirLen;
-		int n = snprintf(path+levelDirLen, path_len, "%d", i);
+		int n = snprintf(path+levelDirLen, path_len, "/%d", i);
 		if (n < 0 || (size_t)n >= path_len) {
 			perror("snprintf");
 		}
 
-		if (access(path, R_OK) < 0) {
-			break;
-		}
-
-		struct Level l = loadLevel(path);
-		if (l.regions == NULL || l.regions_len == 0) {
+		struct stat st;
+		bool onDisk = stat(path, &st) == 0 && access(path, R_OK) == 0;
+		const struct pack_Entry *e = packEntry(path);
+		if (e != NULL && (e->kind != PACK_LEVEL ||
+					e->size < sizeof(struct LevelFile)))
+			e = NULL;
+		if (!onDisk && e == NULL) {
 			break;
 		}
 
-
 		levels_len++;
 		levels = erealloc(levels, levels_len * sizeof(*levels));
-		levels[levels_len-1] = l;
+		struct Level *l = &levels[levels_len-1];
+		*l = (struct Level){0};
+		l->path = ecalloc(strlen(path) + 1, 1);
+		strcpy(l->path, path);
+		if (e != NULL) {
+			const struct LevelFile *h = pack_Data(&game.pack, e);
+			l->packed = true;
+			l->map = pack_Data(&game.pack, e);
+			l->map_len = e->size;
+			l->mtime = h->mtime;
+			l->size = h->size;
+		} else {
+			l->mtime = st.st_mtime;
+			l->size = st.st_size;
+		}
+		pthread_mutex_init(&l->lock, NULL);
 	}
 
 	game.levels = levels;
 	game.levels_len = levels_len;
 }
 
+/* Indexes the levels in arg and starts parsing the one the level select
+ * starts on */
+static void
+loadLevelsJob(void *arg)
+{
+	loadLevels(arg);
+	if (game.curLevel < game.levels_len) {
+		atomic_store(&game.prefetchTarget, game.curLevel);
+		pool_Submit(&game.prefetch, prefetchLevel,
+				&game.levels[game.curLevel]);
+	}
+}
+
+static int
+floorDiv(int a, int b)
+{
+	return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+static void
+freeChunks(void)
+{
+	for (int i = 0; i < game.chunks.cols * game.chunks.rows; i++) {
+		if (game.chunks.surf[i])
+			cairo_surface_destroy(game.chunks.surf[i]);
+	}
+	free(game.chunks.surf);
+	free(game.chunks.opaque);
+	free(game.chunks.baked);
+	free(game.chunks.hits);
+	game.chunks.surf = NULL;
+	game.chunks.opaque = NULL;
+	game.chunks.baked = NULL;
+	game.chunks.hits = NULL;
+	game.chunks.cols = 0;
+	game.chunks.rows = 0;
+}
+
+static void
+bakeRegion(struct Region *reg, int col, int row)
+{
+	int cx = game.chunks.x + col * CHUNK_SIZE;
+	int cy = game.chunks.y + row * CHUNK_SIZE;
+	cairo_surface_t **surf = &game.chunks.surf[row * game.chunks.cols + col];
+	if (*surf == NULL)
+		*surf = createSurface(CHUNK_SIZE, CHUNK_SIZE);
+
+	int id = tileTextures[reg->tile].tile;
+	struct game_Rect tex = game.atlas.rects[id];
+	if (tex.w > BLOCK_SIZE) tex.w = BLOCK_SIZE;
+	if (tex.h > BLOCK_SIZE) tex.h = BLOCK_SIZE;
+
+	cairo_t *cr = cairo_create(*surf);
+	if (game.atlas.opaque[id])
+		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_rectangle(cr, 0, 0, CHUNK_SIZE, CHUNK_SIZE);
+	cairo_clip(cr);
+	struct game_Rect r = reg->rect;
+	for (int y = r.y; y < r.y + r.h; y += BLOCK_SIZE) {
+		if (y + BLOCK_SIZE <= cy || y >= cy + CHUNK_SIZE)
+			continue;
+		for (int x = r.x; x < r.x + r.w; x += BLOCK_SIZE) {
+			if (x + BLOCK_SIZE <= cx || x >= cx + CHUNK_SIZE)
+				continue;
+			cairo_set_source_surface(cr, game.atlas.surf,
+					x - cx - tex.x, y - cy - tex.y);
+			cairo_rectangle(cr, x - cx, y - cy, tex.w, tex.h);
+			cairo_fill(cr);
+		}
+	}
+	cairo_destroy(cr);
+}
+
+static int
+compareInt(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* Renders the tiles of one column of chunks. The regions overlapping it
+ * come from the interval index and are drawn in the order of the level
+ * file, so overlapping tiles look the same as before. */
+static void
+bakeColumn(int col)
+{
+	struct Level *level = game.chunks.level;
+	int cx = game.chunks.x + col * CHUNK_SIZE;
+	int *hits = game.chunks.hits;
+	int len = 0;
+	queryIntervals(level, 0, level->regions_len, cx, cx + CHUNK_SIZE,
+			hits, &len);
+	qsort(hits, len, sizeof(*hits), compareInt);
+
+	for (int i = 0; i < len; i++) {
+		struct Region *reg = &level->regions[hits[i]];
+		if (tileTextures[reg->tile].tile < 0 || reg->rect.w <= 0 || reg->rect.h <= 0)
+			continue;
+		int r0 = (reg->rect.y - game.chunks.y) / CHUNK_SIZE;
+		int r1 = (reg->rect.y + reg->rect.h - 1 - game.chunks.y) / CHUNK_SIZE;
+		for (int row = r0; row <= r1; row++)
+			bakeRegion(reg, col, row);
+	}
+
+	/* Chunks completely covered by opaque tiles can be copied */
+	for (int row = 0; row < game.chunks.rows; row++) {
+		int k = row * game.chunks.cols + col;
+		if (game.chunks.surf[k])
+			game.chunks.opaque[k] = isOpaque(game.chunks.surf[k]);
+	}
+	game.chunks.baked[col] = true;
+}
+
+/* Sets up the chunk grid of a level. The chunks themselves are rendered
+ * by bakeVisible the first time they scroll into view, so long levels
+ * don't pay for parts nobody gets to. */
+static void
+bakeLevel(struct Level *level)
+{
+	freeChunks();
+	game.chunks.level = level;
+	if (level->regions_len == 0)
+		return;
+
+	int x0 = INT_MAX, y0 = INT_MAX;
+	int x1 = INT_MIN, y1 = INT_MIN;
+	for (size_t i = 0; i < level->regions_len; i++) {
+		struct game_Rect r = level->regions[i].rect;
+		if (r.x < x0) x0 = r.x;
+		if (r.y < y0) y0 = r.y;
+		if (r.x + r.w > x1) x1 = r.x + r.w;
+		if (r.y + r.h > y1) y1 = r.y + r.h;
+	}
+	game.chunks.x = floorDiv(x0, CHUNK_SIZE) * CHUNK_SIZE;
+	game.chunks.y = floorDiv(y0, CHUNK_SIZE) * CHUNK_SIZE;
+	game.chunks.cols = floorDiv(x1 - game.chunks.x - 1, CHUNK_SIZE) + 1;
+	game.chunks.rows = floorDiv(y1 - game.chunks.y - 1, CHUNK_SIZE) + 1;
+	game.chunks.surf = ecalloc(game.chunks.cols * game.chunks.rows,
+			sizeof(*game.chunks.surf));
+	game.chunks.opaque = ecalloc(game.chunks.cols * game.chunks.rows,
+			sizeof(*game.chunks.opaque));
+	game.chunks.baked = ecalloc(game.chunks.cols, sizeof(*game.chunks.baked));
+	game.chunks.hits = erealloc(NULL,
+			level->regions_len * sizeof(*game.chunks.hits));
+}
+
+/* Range of chunk columns covering [x0, x1), clamped to the grid */
+static void
+chunkColumns(double x0, double x1, int *c0, int *c1)
+{
+	*c0 = floorDiv((int)x0 - game.chunks.x, CHUNK_SIZE);
+	*c1 = floorDiv((int)x1 - game.chunks.x, CHUNK_SIZE);
+	if (*c0 < 0) *c0 = 0;
+	if (*c1 >= game.chunks.cols) *c1 = game.chunks.cols - 1;
+}
+
+/* Renders the chunks visible in any viewport that haven't been yet. Called
+ * before the viewports are drawn, since those may run in parallel. */
+static void
+bakeVisible(void)
+{
+	for (int j = 0; j <= game.numplayers; j++) {
+		int c0, c1;
+		chunkColumns(game.screens[j].cam_x,
+				game.screens[j].cam_x + game.screens[j].w, &c0, &c1);
+		for (int col = c0; col <= c1; col++) {
+			if (!game.chunks.baked[col])
+				bakeColumn(col);
+		}
+	}
+}
+
+static void
+freeCachedText(struct CachedText *t)
+{
+	if (t->surf)
+		cairo_surface_destroy(t->surf);
+	*t = (struct CachedText){0};
+}
+
+static void
+freeTrailSprites(void)
+{
+	for (int i = 0; i < trailCache.len; i++)
+		cairo_surface_destroy(trailCache.entries[i].surf);
+	trailCache.len = 0;
+}
+
 bool
 readSaveData(struct game_Data *data)
 {
@@ -463,27 +1732,356 @@ writeSaveData(struct game_Data *data)
 	writeSaveFile(data->level);
 }
 
+/* Draw the game at scale times the logical size, independent of the size of
+ * the window, and let the platform scale it up. 0 disables this. */
 void
-game_Init(void)
+game_SetScale(int scale)
 {
-	struct game_Data data = {0};
-	readSaveData(&data);
-	game.level = data.level;
+	game.scale = scale < 0 ? 0 : scale;
+}
+
+/* Tells the game the framebuffer passed to game_UpdateAndDraw is a new one,
+ * so the next frame is drawn whole */
+void
+game_NewTarget(void)
+{
+	game.target++;
+}
+
+/* Size of the framebuffer the platform should pass to game_UpdateAndDraw
+ * for a window of width x height. At a fixed scale it has the aspect ratio
+ * of the window, so stretching it to the window keeps the game's aspect
+ * ratio, and the game is centered in it with black bars around. */
+void
+game_RenderSize(int width, int height, int *rw, int *rh)
+{
+	if (game.scale <= 0) {
+		*rw = width;
+		*rh = height;
+		return;
+	}
+	int lw = LOGICAL_WIDTH * game.scale;
+	int lh = LOGICAL_HEIGHT * game.scale;
+	*rw = lw;
+	*rh = lh;
+	if (width <= 0 || height <= 0)
+		return;
+	if ((long)width * lh > (long)height * lw)
+		*rw = ceil((double)width * lh / height);
+	else
+		*rh = ceil((double)height * lw / width);
+}
+
+/* Makes cr draw the game at its fixed scale in the middle of the width x
+ * height framebuffer, painting the bars around it when the framebuffer is
+ * new */
+static void
+letterbox(cairo_t *cr, int width, int height)
+{
+	double s = game.scale;
+	game.box.full = game.box.target != game.target ||
+		game.box.w != width || game.box.h != height;
+	if (game.box.full) {
+		cairo_set_source_rgba(cr, 0, 0, 0, 1);
+		cairo_paint(cr);
+		game.box.target = game.target;
+		game.box.w = width;
+		game.box.h = height;
+	}
+	game.box.x = (width - (int)(LOGICAL_WIDTH * s)) / 2;
+	game.box.y = (height - (int)(LOGICAL_HEIGHT * s)) / 2;
+
+	cairo_translate(cr, game.box.x, game.box.y);
+	cairo_scale(cr, s, s);
+	cairo_rectangle(cr, 0, 0, LOGICAL_WIDTH, LOGICAL_HEIGHT);
+	cairo_clip(cr);
+}
+
+/* Turns damage to the game at its fixed scale into damage to the
+ * framebuffer */
+static void
+letterboxDamage(struct game_Damage *d)
+{
+	if (game.box.full) {
+		d->rects[0] = (struct game_Rect){0, 0, game.box.w, game.box.h};
+		d->len = 1;
+		return;
+	}
+	double s = game.scale;
+	for (int i = 0; i < d->len; i++) {
+		struct game_Rect *r = &d->rects[i];
+		r->x = game.box.x + floor(r->x * s);
+		r->y = game.box.y + floor(r->y * s);
+		r->w = ceil(r->w * s);
+		r->h = ceil(r->h * s);
+	}
+}
+
+/* Number of simulation ticks per second, TICK_RATE if rate isn't positive */
+void
+game_SetTickRate(int rate)
+{
+	game.tickRate = rate > 0 ? rate : TICK_RATE;
+	game.tick = 1.0 / game.tickRate;
+}
+
+/* Records the input of the levels played to path, see replay.h */
+void
+game_RecordTo(char *path)
+{
+	game.recordPath = path;
+}
+
+static void
+freeLevels(void)
+{
+	pool_Wait(&game.prefetch);
+	for (int i = 0; i < game.levels_len; i++) {
+		unloadLevel(&game.levels[i]);
+		pthread_mutex_destroy(&game.levels[i].lock);
+		free(game.levels[i].path);
+	}
+	free(game.levels);
+	game.levels = NULL;
+	game.levels_len = 0;
+}
+
+/* Compiles every level in dir to the binary format loaded with mmap.
+ * Returns the exit status for the program. */
+int
+game_CompileLevels(char *dir)
+{
+	loadLevels(dir);
+	if (game.levels_len <= 0) {
+		fprintf(stderr, "%s: no levels found\n", dir);
+		return 1;
+	}
+
+	int status = 0;
+	for (int i = 0; i < game.levels_len; i++) {
+		struct Level *level = &game.levels[i];
+		if (!loadLevel(level, level->path)) {
+			status = 1;
+		} else if (!writeLevel(level)) {
+			status = 1;
+		}
+		unloadLevel(level);
+	}
+	freeLevels();
+	return status;
+}
+
+/* Names e name, returns false if it doesn't fit */
+static bool
+packName(struct pack_Entry *e, const char *name)
+{
+	if (snprintf(e->name, sizeof(e->name), "%s", name) >= (int)sizeof(e->name)) {
+		fprintf(stderr, "%s: name too long for a pack\n", name);
+		return false;
+	}
+	return true;
+}
+
+/* Adds the image at dir/name to the pack as the pixels it's drawn from */
+static bool
+packImage(struct pack_Writer *w, char *dir, char *name)
+{
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path)) {
+		fprintf(stderr, "path to %s is too long\n", name);
+		return false;
+	}
+	struct stat st;
+	if (stat(path, &st) < 0)
+		return false;
+	cairo_surface_t *surf = loadCairoSurface(path);
+	if (surf == NULL)
+		return false;
+	cairo_surface_flush(surf);
+	struct pack_Entry e = {
+		.kind = PACK_IMAGE,
+		.format = cairo_image_surface_get_format(surf),
+		.width = cairo_image_surface_get_width(surf),
+		.height = cairo_image_surface_get_height(surf),
+		.stride = cairo_image_surface_get_stride(surf),
+		.mtime = st.st_mtime,
+		.source_size = st.st_size,
+	};
+	e.size = (uint64_t)e.stride * e.height;
+	bool ok = packName(&e, name) &&
+		pack_Add(w, &e, cairo_image_surface_get_data(surf));
+	cairo_surface_destroy(surf);
+	return ok;
+}
+
+/* Adds the file at dir/name to the pack as it is */
+static bool
+packFile(struct pack_Writer *w, char *dir, char *name)
+{
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path)) {
+		fprintf(stderr, "path to %s is too long\n", name);
+		return false;
+	}
+	FILE *f = fopen(path, "rb");
+	struct stat st;
+	if (f == NULL || fstat(fileno(f), &st) < 0) {
+		perror(path);
+		if (f != NULL)
+			fclose(f);
+		return false;
+	}
+	char *data = NULL;
+	size_t len = 0;
+	char buf[BUFSIZ];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+		data = erealloc(data, len + n);
+		memcpy(data + len, buf, n);
+		len += n;
+	}
+	bool ok = !ferror(f);
+	fclose(f);
+
+	struct pack_Entry e = {
+		.kind = PACK_RAW,
+		.mtime = st.st_mtime,
+		.source_size = st.st_size,
+		.size = len,
+	};
+	ok = ok && packName(&e, name) && pack_Add(w, &e, data);
+	free(data);
+	return ok;
+}
+
+/* Packs the images, levels and font in dir into dir/PACK_FILE. Returns the
+ * exit status for the program, nothing is written if anything fails so a
+ * pack never has holes in its levels. */
+int
+game_Pack(char *dir)
+{
+	struct pack_Writer w;
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s/%s", dir, PACK_FILE) >= (int)sizeof(path)) {
+		fprintf(stderr, "path to %s is too long\n", dir);
+		return 1;
+	}
+	pack_Create(&w, path);
+	int status = 0;
+
+	char *tiles[] = {"end", "enemy"};
+	for (size_t i = 0; i < TILE_COUNT + 2; i++) {
+		char *tile = i < TILE_COUNT ? tileTextures[i].name : tiles[i - TILE_COUNT];
+		char name[PACK_NAME_LEN];
+		if (snprintf(name, sizeof(name), "tiles/%s.png", tile) >= (int)sizeof(name) ||
+				!packImage(&w, dir, name)) {
+			fprintf(stderr, "can't load tile %s\n", tile);
+			status = 1;
+		}
+	}
+	for (int i = 0; i < MAX_PLAYERS; i++) {
+		for (int frame = 0; frame < FRAME_NUM; frame++) {
+			char name[PACK_NAME_LEN];
+			if (snprintf(name, sizeof(name), "%d/sprite-%d.png", i, frame) >=
+					(int)sizeof(name)) {
+				fprintf(stderr, "%d/sprite-%d.png: name too long for a pack\n",
+						i, frame);
+				status = 1;
+				continue;
+			}
+			/* Only the first player has to have sprites */
+			if (!packImage(&w, dir, name) && i == 0) {
+				fprintf(stderr, "can't load %s\n", name);
+				status = 1;
+			}
+		}
+	}
+	if (!packFile(&w, dir, FONT_FILE))
+		status = 1;
+
+	if (snprintf(path, sizeof(path), "%s/levels", dir) >= (int)sizeof(path)) {
+		fprintf(stderr, "path to %s is too long\n", dir);
+		pack_Discard(&w);
+		return 1;
+	}
+	loadLevels(path);
+	for (int i = 0; i < game.levels_len; i++) {
+		struct Level *level = &game.levels[i];
+		if (!loadLevel(level, level->path)) {
+			fprintf(stderr, "can't load level %s\n", level->path);
+			status = 1;
+			unloadLevel(level);
+			break;
+		}
+		char *data = NULL;
+		size_t len = 0;
+		FILE *f = open_memstream(&data, &len);
+		if (f == NULL) {
+			perror("open_memstream");
+			exit(1);
+		}
+		writeLevelTo(f, level);
+		fclose(f);
+
+		struct pack_Entry e = {
+			.kind = PACK_LEVEL,
+			.mtime = level->mtime,
+			.source_size = level->size,
+			.size = len,
+		};
+		if (snprintf(e.name, sizeof(e.name), "levels/%d", i + 1) >=
+				(int)sizeof(e.name) || !pack_Add(&w, &e, data))
+			status = 1;
+		free(data);
+		unloadLevel(level);
+	}
+	freeLevels();
+
+	if (status != 0) {
+		fprintf(stderr, "%s not written\n", w.path);
+		pack_Discard(&w);
+	} else if (!pack_Finish(&w)) {
+		status = 1;
+	}
+	return status;
+}
 
+/* Sets up what game_Init and game_InitHeadless both need to play levels,
+ * freed by game_Quit */
+static void
+initSim(void)
+{
 	game.state = STATE_MENU;
 	game.numplayers = 0;
 	game.running = true;
+	if (game.tick <= 0)
+		game_SetTickRate(TICK_RATE);
 
 	game.w = LOGICAL_WIDTH;
 	game.h = LOGICAL_HEIGHT;
 
-	initTileTextures();
+	pack_Open(&game.pack, GAME_DATA_DIR"/"PACK_FILE);
+	entity_Init(&game.entities, MAX_ENTITIES);
+	entity_Init(&game.projectiles, MAX_PROJECTILES);
+	entity_Init(&game.start.entities, MAX_ENTITIES);
+	entity_Init(&game.start.projectiles, MAX_PROJECTILES);
+	entity_Init(&game.quick.entities, MAX_ENTITIES);
+	entity_Init(&game.quick.projectiles, MAX_PROJECTILES);
+	game.enemyIndex.ids = ecalloc(MAX_ENTITIES, sizeof(*game.enemyIndex.ids));
+	game.broad.bodies = ecalloc(MAX_PLAYERS + MAX_ENTITIES,
+			sizeof(*game.broad.bodies));
+}
 
-	loadLevels();
-	if (game.levels_len <= 0) {
-		fprintf(stderr, "failed to load levels\n");
-		exit(1);
-	}
+void
+game_Init(void)
+{
+	struct game_Data data = {0};
+	readSaveData(&data);
+	game.level = data.level;
+
+	initSim();
+	pool_Init();
+	blit_Init();
 
 	FT_Error err = FT_Init_FreeType(&game.ft_lib);
 	if (err) {
@@ -492,41 +2090,186 @@ game_Init(void)
 		exit(1);
 	}
 
-	char *font_file = GAME_DATA_DIR"/fonts/FreeSerifBoldItalic.ttf";
-	err = FT_New_Face(game.ft_lib, font_file, 0, &game.ft_face);
-	if (err) {
+	/* The images, levels and font don't depend on each other, they're
+	 * loaded on the pool and the atlas is built from the decoded images
+	 * once they're all done */
+	struct pool_Group startup = {0};
+	asset_Init(&game.assets, resolveImage, loadImage);
+	prefetchImages(&startup);
+	pool_Submit(&startup, loadLevelsJob, GAME_DATA_DIR"/levels");
+	struct FontJob font = {.file = GAME_DATA_DIR"/"FONT_FILE};
+	pool_Submit(&startup, loadFontJob, &font);
+	pool_Wait(&startup);
+
+	initTileTextures();
+	for (int i = 0; i < MAX_PLAYERS; i++) {
+		loadPlayerImages(i);
+	}
+	if (!buildAtlas()) {
+		fprintf(stderr, "failed to create texture atlas\n");
+		exit(1);
+	}
+
+	if (game.levels_len <= 0) {
+		fprintf(stderr, "failed to load levels\n");
+		exit(1);
+	}
+
+	if (font.err) {
 		fprintf(stderr, "error: failed to load file %s: %s\n",
-				font_file, FT_Error_String(err));
+				font.file, FT_Error_String(font.err));
 		exit(1);
 	}
 	game.font_face = cairo_ft_font_face_create_for_ft_face(game.ft_face, 0);
 }
 
+/* Like game_Init, but only loads the levels. Nothing may be drawn, levels
+ * are played with game_StartLevel and game_Tick. */
 void
-game_Quit(void)
+game_InitHeadless(void)
 {
-	freePlayerTextures();
+	game.headless = true;
+	initSim();
+	for (int i = 0; i < MAX_PLAYERS; i++) {
+		for (int frame = 0; frame < FRAME_NUM; frame++)
+			game.playerFrames[i][frame] = -1;
+	}
 
-	for (int i = 0; i < game.levels_len; i++) {
-		free(game.levels[i].regions);
+	loadLevels(GAME_DATA_DIR"/levels");
+	if (game.levels_len <= 0) {
+		fprintf(stderr, "failed to load levels\n");
+		exit(1);
+	}
+}
+
+void
+game_Quit(void)
+{
+	replay_Close(&game.record);
+	entity_Free(&game.entities);
+	entity_Free(&game.projectiles);
+	entity_Free(&game.start.entities);
+	entity_Free(&game.start.projectiles);
+	entity_Free(&game.quick.entities);
+	entity_Free(&game.quick.projectiles);
+	free(game.enemyIndex.ids);
+	free(game.broad.bodies);
+	free(game.broad.pairs);
+	freeChunks();
+	atlas_Free(&game.atlas);
+	asset_Free(&game.assets);
+
+	freeLevels();
+
+	if (game.headless) {
+		pack_Close(&game.pack);
+		return;
 	}
-	free(game.levels);
-	game.levels_len = 0;
 
 	struct game_Data data = {
 		.level = game.level,
 	};
 	writeSaveData(&data);
 
+	for (int i = 0; i < TEXT_CACHE_SIZE; i++)
+		freeCachedText(&game.text.entries[i]);
+	freeTrailSprites();
 	cairo_font_face_destroy(game.font_face);
 	FT_Done_Face(game.ft_face);
 	FT_Done_Library(game.ft_lib);
+
+	pool_Quit();
+	pack_Close(&game.pack);
+}
+
+static void drawSurface(cairo_t *cr, cairo_surface_t *surf, bool opaque,
+		struct game_Rect *dst);
+
+/* The sizes of most strings depend on the size of the window, so the whole
+ * cache is dropped when it changes. */
+static void
+resizeTextCache(int width, int height)
+{
+	if (game.text.w == width && game.text.h == height)
+		return;
+	game.text.w = width;
+	game.text.h = height;
+	for (int i = 0; i < TEXT_CACHE_SIZE; i++)
+		freeCachedText(&game.text.entries[i]);
+}
+
+/* Returns the cached rendering of text, replacing the least recently used
+ * entry if it isn't cached yet. Returns NULL for strings too long to be
+ * cached. */
+static struct CachedText *
+getText(char *text, int size, struct game_Color fg)
+{
+	size_t len = strlen(text);
+	if (len >= TEXT_MAX_LEN)
+		return NULL;
+
+	struct CachedText *lru = &game.text.entries[0];
+	for (int i = 0; i < TEXT_CACHE_SIZE; i++) {
+		struct CachedText *t = &game.text.entries[i];
+		if (t->surf != NULL && t->size == size &&
+				memcmp(&t->color, &fg, sizeof(fg)) == 0 &&
+				strcmp(t->text, text) == 0) {
+			t->used = ++game.text.clock;
+			return t;
+		}
+		if (t->used < lru->used)
+			lru = t;
+	}
+
+	struct CachedText *t = lru;
+	freeCachedText(t);
+	memcpy(t->text, text, len + 1);
+	t->size = size;
+	t->color = fg;
+	t->used = ++game.text.clock;
+
+	cairo_t *cr = game.cr;
+	cairo_save(cr);
+	cairo_set_font_size(cr, (double)size);
+	cairo_text_extents(cr, text, &t->ext);
+	cairo_restore(cr);
+
+	t->x = floor(t->ext.x_bearing) - 1;
+	t->y = floor(t->ext.y_bearing) - 1;
+	int w = ceil(t->ext.x_bearing + t->ext.width) - t->x + 1;
+	int h = ceil(t->ext.y_bearing + t->ext.height) - t->y + 1;
+
+	t->w = w;
+	t->h = h;
+	t->surf = createSurface(w, h);
+	cr = cairo_create(t->surf);
+	cairo_set_font_face(cr, game.font_face);
+	cairo_set_font_size(cr, (double)size);
+	cairo_move_to(cr, -t->x, -t->y);
+	cairo_set_source_rgba(cr, CAIRO_RGBA(fg));
+	cairo_show_text(cr, text);
+	cairo_destroy(cr);
+	cairo_surface_flush(t->surf);
+
+	return t;
 }
 
 static void
 renderText(char *text, int size, struct game_Color fg, int x, int y)
 {
 	cairo_t *cr = game.cr;
+	struct CachedText *t = getText(text, size, fg);
+	if (t != NULL) {
+		struct game_Rect dst = {
+			.x = x + t->x,
+			.y = y + size/2 + t->y,
+			.w = t->w,
+			.h = t->h,
+		};
+		drawSurface(cr, t->surf, false, &dst);
+		return;
+	}
+
 	cairo_save(cr);
 	cairo_set_font_size(cr, (double)size);
 	cairo_move_to(cr, x, y + size/2);
@@ -539,11 +2282,16 @@ static void
 measureText(char *text, int size, int *w, int *h)
 {
 	cairo_text_extents_t ext;
-	cairo_t *cr = game.cr;
-	cairo_save(cr);
-	cairo_set_font_size(cr, (double)size);
-	cairo_text_extents(cr, text, &ext);
-	cairo_restore(cr);
+	struct CachedText *t = getText(text, size, GAME_RGB(0xFF, 0xFF, 0xFF));
+	if (t != NULL) {
+		ext = t->ext;
+	} else {
+		cairo_t *cr = game.cr;
+		cairo_save(cr);
+		cairo_set_font_size(cr, (double)size);
+		cairo_text_extents(cr, text, &ext);
+		cairo_restore(cr);
+	}
 
 	if (w) *w = ext.width;
 	if (h) *h = ext.height;
@@ -573,9 +2321,8 @@ drwTextScreenCentered(char *text, int size)
 }
 
 static void
-fillRect(struct game_Color c, struct game_Rect *rect)
+fillRect(cairo_t *cr, struct game_Color c, struct game_Rect *rect)
 {
-	cairo_t *cr = game.cr;
 	cairo_set_source_rgba(cr, CAIRO_RGBA(c));
 	if (rect == NULL) {
 		cairo_rectangle(cr, 0, 0, game.w, game.h);
@@ -598,9 +2345,9 @@ drwHomeMenu(int gaps, int focus, int size, int width, int height)
 
 	for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
 		if ((int)i == focus) {
-			fillRect(GAME_RGB(20, 190, 180), &options[i]);
+			fillRect(game.cr, GAME_RGB(20, 190, 180), &options[i]);
 		} else {
-			fillRect(GAME_RGB(20, 150, 180), &options[i]);
+			fillRect(game.cr, GAME_RGB(20, 150, 180), &options[i]);
 		}
 	}
 
@@ -631,19 +2378,17 @@ down(int i, bool keyReleased)
 void
 jump(int i, bool keyReleased)
 {
-	static bool jumpHigher = false;
-
 #define MIN_PLAYER_DY (-JUMP_ACCEL * 2)
 	if (keyReleased || player[i].dy < MIN_PLAYER_DY) {
-		jumpHigher = false;
+		player[i].jumpHigher = false;
 		return;
 	}
-	if (!jumpHigher && !player[i].inAir) {
-		jumpHigher = true;
+	if (!player[i].jumpHigher && !player[i].inAir) {
+		player[i].jumpHigher = true;
 	}
 
-	if (jumpHigher) {
-		player[i].dy -= JUMP_ACCEL;
+	if (player[i].jumpHigher) {
+		player[i].dy -= JUMP_ACCEL * game.tick * DY_RATE;
 		player[i].inAir = true;
 	}
 }
@@ -652,7 +2397,7 @@ void
 right(int i, bool keyReleased)
 {
 
-	if (player[i].x + player[i].w >= stage_length)
+	if (keyReleased || player[i].x + player[i].w >= stage_length)
 		return;
 
 #if 0
@@ -666,7 +2411,7 @@ right(int i, bool keyReleased)
 		uint32_t r = SDL_GetTicks();
 		if (r - released < 200) {
 			player[i].dx = SPEED_MAX * 2;
-			player[i].current = &player[i].frame[1];
+			player[i].current = 1;
 			return;
 		}
 		released = 0;
@@ -674,17 +2419,17 @@ right(int i, bool keyReleased)
 #endif
 
 	if (player[i].dx < SPEED_MAX)
-		player[i].dx += SPEED_ACCEL;
+		player[i].dx += SPEED_ACCEL * game.tick;
 	else
 		player[i].dx = SPEED_MAX;
 
-	player[i].current = &player[i].frame[1];
+	player[i].current = 1;
 }
 
 void
 left(int i, bool keyReleased)
 {
-	if (player[i].x <= 0)
+	if (keyReleased || player[i].x <= 0)
 		return;
 
 #if 0
@@ -698,7 +2443,7 @@ left(int i, bool keyReleased)
 		uint32_t r = SDL_GetTicks();
 		if (r - released < 200) {
 			player[i].dx = -SPEED_MAX * 2;
-			player[i].current = &player[i].frame[2];
+			player[i].current = 2;
 			return;
 		}
 		released = 0;
@@ -708,77 +2453,45 @@ left(int i, bool keyReleased)
 	if (player[i].dx < -SPEED_MAX)
 		player[i].dx = -SPEED_MAX;
 	else
-		player[i].dx -= SPEED_ACCEL;
+		player[i].dx -= SPEED_ACCEL * game.tick;
 
-	player[i].current = &player[i].frame[2];
+	player[i].current = 2;
 }
 
 void
 shoot(int i)
 {
-	if (player[i].proj.active) {
+	if (player[i].cooldown > 0)
 		return;
-	}
-	player[i].proj.x = player[i].x + player[i].w/2;
-	player[i].proj.y = player[i].y + player[i].h/2;
-	player[i].proj.initial_x = player[i].proj.x;
-	player[i].proj.active = true;
-	player[i].proj.retToPlayer = false;
-	player[i].proj.dy = 0;
 
-	// XXX: this seems really magical if you don't know that frame[2]
+	int id = entity_Spawn(&game.projectiles, ENTITY_PROJECTILE,
+			player[i].x + player[i].w/2, player[i].y + player[i].h/2,
+			PROJ_SIZE, PROJ_SIZE);
+	if (id < 0)
+		return;
+	game.projectiles.owner[id] = i;
+	player[i].cooldown = PROJ_COOLDOWN;
+
+	// XXX: this seems really magical if you don't know that frame 2
 	// contains sprite for looking left.
-	if (player[i].current == &player[i].frame[2]) {
-		player[i].proj.dx = -PROJ_DX;
+	if (player[i].current == 2) {
+		game.projectiles.dx[id] = -PROJ_DX;
 	} else {
-		player[i].proj.dx = PROJ_DX;
+		game.projectiles.dx[id] = PROJ_DX;
 	}
 }
 
 static double
-playerVerticalCollision(int i)
+playerVerticalCollision(int i, double dt)
 {
-	double dy = player[i].dy;
+	double dy = player[i].dy * dt * DY_RATE;
 
 	/* Player isn't moving and collision detection is unnecessary */
 	if (dy == 0)
 		return player[i].y;
 
-	struct game_FRect p = {
-		(float)player[i].x,
-		(float)player[i].y,
-		(float)player[i].w,
-		(float)player[i].h + dy,
-	};
-
-	struct Region *reg = NULL;
-	struct Level *level = &game.levels[game.curLevel];
-	for (size_t j = 0; j < level->regions_len; j++) {
-		//if (level.regions[j].rect.x + level.regions[j].rect.w < p.x)
-		//	continue;
-		//if (p.x + p.w < level.regions[j].rect.x)
-		//	continue;
-
-		struct game_FRect r = {
-			.x = (float)level->regions[j].rect.x,
-			.y = (float)level->regions[j].rect.y,
-			.w = (float)level->regions[j].rect.w,
-			.h = (float)level->regions[j].rect.h,
-		};
-		// TODO: this code will allow for clipping, we should go
-		// through all the regions and choose the one in between the
-		// initial and final postition of player and choose the
-		// platform that's closest to the initial position of player.
-		if (game_HasIntersectionF(p, r)) {
-			if (reg != NULL) {
-				//if reg->rect.y is farther from p.y than r.y {
-				//	reg = &level.regions[j];
-				//}
-			} else {
-				reg = &level->regions[j];
-			}
-		}
-	}
+	struct Region *reg = sweepRegions(&game.levels[game.curLevel],
+			player[i].x, player[i].y, player[i].w, player[i].h, true, dy);
 
 	if (reg != NULL) {
 		player[i].dy = 0;
@@ -805,7 +2518,7 @@ movePlayerVertical(int i, double dt)
 		player[i].dy = TERMINAL_VELOCITY;
 	}
 
-	player[i].y = playerVerticalCollision(i);
+	player[i].y = playerVerticalCollision(i, dt);
 	player[i].dy += GRAVITY * dt;
 
 	if (player[i].y > stage_height) {
@@ -814,47 +2527,29 @@ movePlayerVertical(int i, double dt)
 }
 
 static double
-playerHorizontalCollision(int i)
+playerHorizontalCollision(int i, double dt)
 {
-	double dx = player[i].dx;
+	double dx = player[i].dx * dt;
 
 	/* Player isn't moving and collision detection is unnecessary */
 	if (dx == 0)
 		return player[i].x;
 
-	struct game_FRect p = {
-		(float)player[i].x,
-		(float)player[i].y,
-		(float)player[i].w + dx,
-		(float)player[i].h
-	};
-
-	struct Level *level = &game.levels[game.curLevel];
-	for (size_t j = 0; j < level->regions_len; j++) {
-		struct game_FRect r = {
-			.x = (float)level->regions[j].rect.x,
-			.y = (float)level->regions[j].rect.y,
-			.w = (float)level->regions[j].rect.w,
-			.h = (float)level->regions[j].rect.h,
-		};
-		// TODO: this code will allow for clipping, we should go
-		// through all the regions and choose the one in between the
-		// initial and final postition of player and choose the
-		// platform that's closest to the initial position of player.
-		if (game_HasIntersectionF(p, r)) {
-			if (dx > 0) { /* Player is going right */
-				player[i].dx = 0;
-				return r.x - player[i].w;
-			} else if (dx < 0) { /* Player is going left */
-				player[i].dx = 0;
-				return r.x + r.w;
-			}
-		}
+	struct Region *reg = sweepRegions(&game.levels[game.curLevel],
+			player[i].x, player[i].y, player[i].w, player[i].h, false, dx);
+	if (reg != NULL) {
+		player[i].dx = 0;
+		if (dx > 0) /* Player is going right */
+			return reg->rect.x - player[i].w;
+		else /* Player is going left */
+			return reg->rect.x + reg->rect.w;
 	}
 
 	return player[i].x + dx;
 }
 
+/* Follows the players where they are drawn, so it's called every frame
+ * rather than every tick. */
 static void
 moveCameras(void)
 {
@@ -864,14 +2559,14 @@ moveCameras(void)
 			double *cam_y = &game.screens[i].cam_y;
 			double width = game.screens[i].w;
 			double height = game.screens[i].h;
-			double avg_x = player[i].x;
+			double avg_x = player[i].draw_x;
 			if (avg_x > width / 2 && avg_x < stage_length - width / 2) {
 				if (avg_x - *cam_x < -0.9 || avg_x - *cam_x > 0.9) {
 					*cam_x = avg_x - (width / 2);
 				}
 			}
 
-			double avg_y = player[i].y;;
+			double avg_y = player[i].draw_y;
 			*cam_y = avg_y - height / 2;
 			if (*cam_y > stage_height - width) {
 				*cam_y = stage_height - width;
@@ -885,8 +2580,8 @@ moveCameras(void)
 		double total_x = 0;
 		double total_y = 0;
 		for (int i = 0; i <= game.numplayers; i++) {
-			total_x += player[i].x;
-			total_y += player[i].y;
+			total_x += player[i].draw_x;
+			total_y += player[i].draw_y;
 		}
 
 		double avg_x = total_x / (double)(game.numplayers + 1);
@@ -904,56 +2599,6 @@ moveCameras(void)
 	}
 }
 
-static void
-movePlayerProjectile(int i, float dt)
-{
-	if (!player[i].proj.active) {
-		return;
-	}
-	if (player[i].proj.retToPlayer) {
-		struct game_FRect pl = {
-			player[i].x,
-			player[i].y,
-			player[i].w,
-			player[i].h
-		};
-		struct game_FRect pr = {
-			player[i].proj.x,
-			player[i].proj.y,
-			PROJ_SIZE,
-			PROJ_SIZE,
-		};
-		if (game_HasIntersectionF(pl, pr)) {
-			player[i].proj.active = false;
-			player[i].proj.retToPlayer = false;
-		} else {
-			// XXX: maybe move in a curve to the
-			// player instead of a straight line
-			float eps = 4;
-			if (player[i].x - player[i].proj.x > eps) {
-				player[i].proj.dx = PROJ_DX;
-			} else if (player[i].x - player[i].proj.x < -eps) {
-				player[i].proj.dx = -PROJ_DX;
-			} else {
-				player[i].proj.dx = 0;
-			}
-			if (player[i].y - player[i].proj.y > eps) {
-				player[i].proj.dy = PROJ_DX;
-			} else if (player[i].y - player[i].proj.y < -eps) {
-				player[i].proj.dy = -PROJ_DX;
-			} else {
-				player[i].proj.dy = 0;
-			}
-		}
-	} else if (fabs(player[i].proj.x-player[i].proj.initial_x) > PROJ_RET) {
-		player[i].proj.retToPlayer = true;
-	}
-
-	player[i].proj.x += player[i].proj.dx * dt;
-	player[i].proj.y += player[i].proj.dy * dt;
-
-}
-
 static void
 movePlayerTrail(int i, float dt)
 {
@@ -985,6 +2630,11 @@ movePlayerTrail(int i, float dt)
 		player[i].trail.x += player[i].trail.dx * dt;
 		player[i].trail.y += player[i].trail.dy * dt;
 	}
+
+	int head = (player[i].trail.hist_head + 1) % TRAIL_LEN;
+	player[i].trail.hist_x[head] = player[i].trail.x;
+	player[i].trail.hist_y[head] = player[i].trail.y;
+	player[i].trail.hist_head = head;
 }
 
 static void
@@ -996,8 +2646,8 @@ movePlayerHorizontal(int i, float dt)
 		player[i].dx = 0;
 	}
 
-	player[i].dx = player[i].dx * FRICTION * dt;
-	player[i].x = playerHorizontalCollision(i);
+	player[i].dx *= powf(FRICTION, dt * DY_RATE);
+	player[i].x = playerHorizontalCollision(i, dt);
 
 	if (player[i].x + player[i].w >= stage_length || player[i].x <= 0) {
 		player[i].dx = 0;
@@ -1007,7 +2657,6 @@ movePlayerHorizontal(int i, float dt)
 static void
 movePlayers(float dt)
 {
-	/* TODO: Player-Player collision */
 	for (int i = 0; i <= game.numplayers; i++) {
 		struct Level *level = &game.levels[game.curLevel];
 		struct game_FRect p = {
@@ -1030,70 +2679,606 @@ movePlayers(float dt)
 
 		movePlayerVertical(i, dt);
 		movePlayerHorizontal(i, dt);
-		movePlayerProjectile(i, dt);
 		movePlayerTrail(i, dt);
+		if (player[i].cooldown > 0)
+			player[i].cooldown -= dt;
 	}
+}
 
-	moveCameras();
+static void
+spawnEntities(struct Level *level)
+{
+	entity_Clear(&game.entities);
+	entity_Clear(&game.projectiles);
+	for (size_t i = 0; i < level->enemies_len; i++) {
+		int id = entity_Spawn(&game.entities, ENTITY_ENEMY,
+				level->enemies[i].x, level->enemies[i].y,
+				ENEMY_SIZE, ENEMY_SIZE);
+		if (id < 0)
+			break;
+		game.entities.dx[id] = -ENEMY_SPEED;
+	}
 }
 
+/* Enemies fall onto platforms and walk along them, turning around when
+ * they run into a wall or get to the edge. */
 static void
-drawTrail(int x1, int y1, int x2, int y2, int size, struct game_Color color)
+moveEntities(float dt)
 {
-	cairo_t *cr = game.cr;
-	cairo_pattern_t *pat;
-	pat = cairo_pattern_create_radial(x1, y1, size/2, x2, y2, size/2);
+	struct Entities *e = &game.entities;
+	struct Level *level = &game.levels[game.curLevel];
 
-	color.a = 0;
-	cairo_pattern_add_color_stop_rgba(pat, 1, CAIRO_RGBA(color));
+	memcpy(e->prev_x, e->x, e->len * sizeof(*e->x));
+	memcpy(e->prev_y, e->y, e->len * sizeof(*e->y));
 
-	color.a = 0xff;
-	cairo_pattern_add_color_stop_rgba(pat, 0, CAIRO_RGBA(color));
+	for (int i = 0; i < e->len; i++) {
+		if (!(e->flags[i] & ENTITY_ALIVE) || e->type[i] != ENTITY_ENEMY)
+			continue;
 
-	cairo_move_to(cr, x1, y1);
-	cairo_line_to(cr, x1, y2);
-	cairo_line_to(cr, x2, y2);
-	cairo_line_to(cr, x2, y1);
-	cairo_close_path(cr);
+		e->dy[i] += GRAVITY * dt;
+		if (e->dy[i] > TERMINAL_VELOCITY)
+			e->dy[i] = TERMINAL_VELOCITY;
+		double d = e->dy[i] * dt * DY_RATE;
+		struct Region *reg = sweepRegions(level, e->x[i], e->y[i],
+				e->w[i], e->h[i], true, d);
+		bool grounded = reg != NULL && d > 0;
+		if (reg != NULL) {
+			e->y[i] = d > 0 ? reg->rect.y - e->h[i] : reg->rect.y + reg->rect.h;
+			e->dy[i] = 0;
+		} else {
+			e->y[i] += d;
+		}
+
+		d = e->dx[i] * dt;
+		reg = sweepRegions(level, e->x[i], e->y[i], e->w[i], e->h[i],
+				false, d);
+		if (reg != NULL) {
+			e->x[i] = d > 0 ? reg->rect.x - e->w[i] : reg->rect.x + reg->rect.w;
+			e->dx[i] = -e->dx[i];
+		} else {
+			e->x[i] += d;
+		}
+
+		if (grounded) {
+			double lead = e->dx[i] > 0 ? e->x[i] + e->w[i] - 1 : e->x[i];
+			if (sweepRegions(level, lead, e->y[i], 1, e->h[i], true, 1) == NULL) {
+				e->x[i] = e->prev_x[i];
+				e->dx[i] = -e->dx[i];
+			}
+		}
+
+		if (e->y[i] > stage_height)
+			entity_Despawn(e, i);
+	}
+}
+
+static int
+compareEnemyX(const void *a, const void *b)
+{
+	float xa = game.entities.x[*(const int *)a];
+	float xb = game.entities.x[*(const int *)b];
+	if (xa != xb)
+		return xa < xb ? -1 : 1;
+	return *(const int *)a - *(const int *)b;
+}
+
+/* Rebuilds the x-sorted index of live enemies, returns the widest one */
+static float
+indexEnemies(void)
+{
+	struct Entities *e = &game.entities;
+	float maxW = 0;
+	game.enemyIndex.len = 0;
+	for (int i = 0; i < e->len; i++) {
+		if (!(e->flags[i] & ENTITY_ALIVE) || e->type[i] != ENTITY_ENEMY)
+			continue;
+		game.enemyIndex.ids[game.enemyIndex.len++] = i;
+		if (e->w[i] > maxW)
+			maxW = e->w[i];
+	}
+	qsort(game.enemyIndex.ids, game.enemyIndex.len,
+			sizeof(*game.enemyIndex.ids), compareEnemyX);
+	return maxW;
+}
+
+/* Returns a live enemy overlapping the box, or -1 */
+static int
+hitEnemy(float x, float y, float w, float h, float maxW)
+{
+	struct Entities *e = &game.entities;
+	int *ids = game.enemyIndex.ids;
+
+	/* First enemy that may reach x */
+	int lo = 0, hi = game.enemyIndex.len;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (e->x[ids[mid]] + maxW <= x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (int k = lo; k < game.enemyIndex.len && e->x[ids[k]] < x + w; k++) {
+		int id = ids[k];
+		if (!(e->flags[id] & ENTITY_ALIVE))
+			continue;
+		if (x < e->x[id] + e->w[id] && x + w > e->x[id] &&
+				y < e->y[id] + e->h[id] && y + h > e->y[id])
+			return id;
+	}
+	return -1;
+}
+
+/* Projectiles fly straight until they've gone PROJ_RET, then head back to
+ * whoever shot them. They're gone once they get back, hit a wall or hit an
+ * enemy, which dies. */
+static void
+moveProjectiles(float dt)
+{
+	struct Entities *p = &game.projectiles;
+	struct Level *level = &game.levels[game.curLevel];
+	if (p->count == 0)
+		return;
+
+	memcpy(p->prev_x, p->x, p->len * sizeof(*p->x));
+	memcpy(p->prev_y, p->y, p->len * sizeof(*p->y));
+	float maxW = indexEnemies();
+
+	for (int i = 0; i < p->len; i++) {
+		if (!(p->flags[i] & ENTITY_ALIVE))
+			continue;
+		p->age[i] += dt;
+
+		int o = p->owner[i];
+		if (p->flags[i] & ENTITY_RETURNING) {
+			struct game_FRect pl = {
+				player[o].x,
+				player[o].y,
+				player[o].w,
+				player[o].h
+			};
+			struct game_FRect pr = {p->x[i], p->y[i], p->w[i], p->h[i]};
+			if (game_HasIntersectionF(pl, pr)) {
+				entity_Despawn(p, i);
+				continue;
+			}
+			// XXX: maybe move in a curve to the
+			// player instead of a straight line
+			float eps = 4;
+			if (player[o].x - p->x[i] > eps) {
+				p->dx[i] = PROJ_DX;
+			} else if (player[o].x - p->x[i] < -eps) {
+				p->dx[i] = -PROJ_DX;
+			} else {
+				p->dx[i] = 0;
+			}
+			if (player[o].y - p->y[i] > eps) {
+				p->dy[i] = PROJ_DX;
+			} else if (player[o].y - p->y[i] < -eps) {
+				p->dy[i] = -PROJ_DX;
+			} else {
+				p->dy[i] = 0;
+			}
+		} else if (p->age[i] * PROJ_DX > PROJ_RET) {
+			p->flags[i] |= ENTITY_RETURNING;
+		}
+
+		float d = p->dx[i] * dt;
+		if (sweepRegions(level, p->x[i], p->y[i], p->w[i], p->h[i], false, d)) {
+			entity_Despawn(p, i);
+			continue;
+		}
+		p->x[i] += d;
+		d = p->dy[i] * dt;
+		if (sweepRegions(level, p->x[i], p->y[i], p->w[i], p->h[i], true, d)) {
+			entity_Despawn(p, i);
+			continue;
+		}
+		p->y[i] += d;
+
+		int e = hitEnemy(p->x[i], p->y[i], p->w[i], p->h[i], maxW);
+		if (e >= 0) {
+			entity_Despawn(&game.entities, e);
+			entity_Despawn(p, i);
+		}
+	}
+}
+
+static int
+compareBodyX(const void *a, const void *b)
+{
+	const struct Body *ba = a;
+	const struct Body *bb = b;
+	if (ba->x != bb->x)
+		return ba->x < bb->x ? -1 : 1;
+	return ba->id - bb->id;
+}
+
+static void
+addPair(int a, int b)
+{
+	if (game.broad.pairs_len >= game.broad.pairs_cap) {
+		game.broad.pairs_cap = game.broad.pairs_cap ?
+			game.broad.pairs_cap * 2 : 64;
+		game.broad.pairs = erealloc(game.broad.pairs,
+				game.broad.pairs_cap * sizeof(*game.broad.pairs));
+	}
+	game.broad.pairs[game.broad.pairs_len][0] = a;
+	game.broad.pairs[game.broad.pairs_len][1] = b;
+	game.broad.pairs_len++;
+}
+
+/* Sort and sweep on x: after sorting the bodies by their left edge, the
+ * only bodies that can overlap one are those after it that start before
+ * its right edge. Pairs of enemies are left out, they walk through each
+ * other. */
+static void
+findPairs(void)
+{
+	struct Entities *e = &game.entities;
+	struct Body *bodies = game.broad.bodies;
+	int n = 0;
+
+	for (int i = 0; i <= game.numplayers; i++) {
+		bodies[n++] = (struct Body){
+			player[i].x, player[i].y, player[i].w, player[i].h, i
+		};
+	}
+	for (int i = 0; i < e->len; i++) {
+		if (!(e->flags[i] & ENTITY_ALIVE) || e->type[i] != ENTITY_ENEMY)
+			continue;
+		bodies[n++] = (struct Body){
+			e->x[i], e->y[i], e->w[i], e->h[i], MAX_PLAYERS + i
+		};
+	}
+	game.broad.len = n;
+	qsort(bodies, n, sizeof(*bodies), compareBodyX);
+
+	game.broad.pairs_len = 0;
+	for (int i = 0; i < n; i++) {
+		float right = bodies[i].x + bodies[i].w;
+		for (int k = i + 1; k < n && bodies[k].x < right; k++) {
+			if (bodies[i].id >= MAX_PLAYERS && bodies[k].id >= MAX_PLAYERS)
+				continue;
+			if (bodies[i].y >= bodies[k].y + bodies[k].h ||
+					bodies[k].y >= bodies[i].y + bodies[i].h)
+				continue;
+			addPair(bodies[i].id, bodies[k].id);
+		}
+	}
+}
+
+/* Moves player i by d without going into the terrain or off the stage */
+static void
+nudgePlayer(int i, bool vertical, double d)
+{
+	struct Region *reg = sweepRegions(&game.levels[game.curLevel],
+			player[i].x, player[i].y, player[i].w, player[i].h,
+			vertical, d);
+	if (vertical) {
+		if (reg == NULL)
+			player[i].y += d;
+		else if (d > 0)
+			player[i].y = reg->rect.y - player[i].h;
+		else
+			player[i].y = reg->rect.y + reg->rect.h;
+		return;
+	}
+
+	if (reg == NULL)
+		player[i].x += d;
+	else if (d > 0)
+		player[i].x = reg->rect.x - player[i].w;
+	else
+		player[i].x = reg->rect.x + reg->rect.w;
+	if (player[i].x < 0)
+		player[i].x = 0;
+	if (player[i].x + player[i].w > stage_length)
+		player[i].x = stage_length - player[i].w;
+}
+
+/* Pushes two overlapping players apart the shorter way. A player that
+ * ends up on top stands on the other one. */
+static void
+collidePlayers(int a, int b)
+{
+	double ox = fmin(player[a].x + player[a].w, player[b].x + player[b].w) -
+		fmax(player[a].x, player[b].x);
+	double oy = fmin(player[a].y + player[a].h, player[b].y + player[b].h) -
+		fmax(player[a].y, player[b].y);
+	if (ox <= 0 || oy <= 0)
+		return;
+
+	if (oy < ox) {
+		int top = player[a].y < player[b].y ? a : b;
+		nudgePlayer(top, true, -oy);
+		if (player[top].dy > 0)
+			player[top].dy = 0;
+		player[top].inAir = false;
+		return;
+	}
+
+	bool aLeft = player[a].x < player[b].x ||
+		(player[a].x == player[b].x && a < b);
+	nudgePlayer(a, false, aLeft ? -ox / 2 : ox / 2);
+	nudgePlayer(b, false, aLeft ? ox / 2 : -ox / 2);
+}
+
+/* A player coming down on an enemy kills it and bounces off, touching it
+ * any other way kills the player. */
+static void
+collideEnemy(int i, int id)
+{
+	struct Entities *e = &game.entities;
+	if (!(e->flags[id] & ENTITY_ALIVE))
+		return;
+	struct game_FRect p = {player[i].x, player[i].y, player[i].w, player[i].h};
+	struct game_FRect r = {e->x[id], e->y[id], e->w[id], e->h[id]};
+	if (!game_HasIntersectionF(p, r))
+		return;
+
+	if (player[i].dy > 0 &&
+			player[i].prev_y + player[i].h <= e->prev_y[id] + e->h[id] / 2) {
+		entity_Despawn(e, id);
+		player[i].dy = -STOMP_BOUNCE;
+		player[i].inAir = true;
+		player[i].jumpHigher = false;
+	} else {
+		game.state = STATE_DEAD;
+	}
+}
+
+static void
+collideBodies(void)
+{
+	findPairs();
+	for (size_t i = 0; i < game.broad.pairs_len && game.state == STATE_PLAY; i++) {
+		int a = game.broad.pairs[i][0];
+		int b = game.broad.pairs[i][1];
+		if (a >= MAX_PLAYERS)
+			collideEnemy(b, a - MAX_PLAYERS);
+		else if (b >= MAX_PLAYERS)
+			collideEnemy(a, b - MAX_PLAYERS);
+		else
+			collidePlayers(a, b);
+	}
+}
+
+/* Places players alpha of the way between where they were
+ * at the start of the last tick and where they are now. */
+static void
+interpolatePlayers(double alpha)
+{
+	for (int i = 0; i <= game.numplayers; i++) {
+		struct Player *p = &player[i];
+		p->draw_x = p->prev_x + (p->x - p->prev_x) * alpha;
+		p->draw_y = p->prev_y + (p->y - p->prev_y) * alpha;
+	}
+}
+
+/* Returns a circle of diameter size filled with a gradient going from
+ * color in the center to transparent at the edge. The caller owns a
+ * reference to the returned surface. */
+static cairo_surface_t *
+getTrailSprite(int size, struct game_Color color)
+{
+	cairo_surface_t *surf = NULL;
+	pthread_mutex_lock(&trailCache.lock);
+	for (int i = 0; i < trailCache.len; i++) {
+		if (trailCache.entries[i].size == size &&
+				memcmp(&trailCache.entries[i].color, &color,
+					sizeof(color)) == 0) {
+			surf = cairo_surface_reference(trailCache.entries[i].surf);
+			goto out;
+		}
+	}
 
+	surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, size, size);
+	cairo_t *cr = cairo_create(surf);
+	cairo_pattern_t *pat = cairo_pattern_create_radial(size/2.0, size/2.0, 0,
+			size/2.0, size/2.0, size/2.0);
+	struct game_Color stop = color;
+	stop.a = 0xff;
+	cairo_pattern_add_color_stop_rgba(pat, 0, CAIRO_RGBA(stop));
+	stop.a = 0;
+	cairo_pattern_add_color_stop_rgba(pat, 1, CAIRO_RGBA(stop));
 	cairo_set_source(cr, pat);
-	cairo_fill(cr);
+	cairo_paint(cr);
 	cairo_pattern_destroy(pat);
+	cairo_destroy(cr);
+	cairo_surface_flush(surf);
+
+	int n = trailCache.len;
+	if (n == TRAIL_CACHE_SIZE) {
+		/* Shouldn't happen with the few trail colors there are */
+		n = 0;
+		cairo_surface_destroy(trailCache.entries[0].surf);
+	} else {
+		trailCache.len++;
+	}
+	trailCache.entries[n].size = size;
+	trailCache.entries[n].color = color;
+	trailCache.entries[n].surf = cairo_surface_reference(surf);
+out:
+	pthread_mutex_unlock(&trailCache.lock);
+	return surf;
 }
 
+/* Draws the past positions of the trail of player i, oldest first, getting
+ * smaller and more transparent with age. */
 static void
-drawTexture(cairo_surface_t *tex, struct game_Rect *src, struct game_Rect *dst)
+drawTrail(cairo_t *cr, int i, double x, double y, int size)
 {
-	cairo_t *cr = game.cr;
-	cairo_save(cr);
+	cairo_surface_t *sprite = getTrailSprite(size, player[i].trail.color);
+	for (int k = 0; k < TRAIL_LEN; k++) {
+		int n = (player[i].trail.hist_head + 1 + k) % TRAIL_LEN;
+		double scale = (double)(k + 1) / TRAIL_LEN;
+		cairo_save(cr);
+		cairo_translate(cr, x + player[i].trail.hist_x[n],
+				y + player[i].trail.hist_y[n]);
+		cairo_scale(cr, scale, scale);
+		cairo_set_source_surface(cr, sprite, -size/2.0, -size/2.0);
+		cairo_paint_with_alpha(cr, scale);
+		cairo_restore(cr);
+	}
+	cairo_surface_destroy(sprite);
+}
+
+/*
+ * Draws the src part of the image surface surf at x, y with blit_Over, or
+ * blit_Copy when surf is opaque, if cr only translates by whole pixels and
+ * its clip is a list of rectangles, which covers all the tiles and sprites.
+ * Returns false if cairo has to be used instead.
+ */
+static bool
+blitSurface(cairo_t *cr, cairo_surface_t *surf, bool opaque,
+		struct game_Rect src, int x, int y)
+{
+	cairo_surface_t *target = cairo_get_target(cr);
+	if (cairo_get_group_target(cr) != target ||
+			cairo_surface_get_type(target) != CAIRO_SURFACE_TYPE_IMAGE ||
+			cairo_image_surface_get_format(target) != CAIRO_FORMAT_ARGB32 ||
+			cairo_image_surface_get_format(surf) != CAIRO_FORMAT_ARGB32 ||
+			cairo_get_operator(cr) != CAIRO_OPERATOR_OVER) {
+		return false;
+	}
+
+	cairo_matrix_t m;
+	cairo_get_matrix(cr, &m);
+	if (m.xx != 1 || m.yy != 1 || m.xy != 0 || m.yx != 0 ||
+			m.x0 != floor(m.x0) || m.y0 != floor(m.y0)) {
+		return false;
+	}
+	double tsx, tsy, ssx, ssy;
+	cairo_surface_get_device_scale(target, &tsx, &tsy);
+	cairo_surface_get_device_scale(surf, &ssx, &ssy);
+	if (tsx != 1 || tsy != 1 || ssx != 1 || ssy != 1)
+		return false;
+
+	cairo_rectangle_list_t *clip = cairo_copy_clip_rectangle_list(cr);
+	if (clip->status != CAIRO_STATUS_SUCCESS) {
+		cairo_rectangle_list_destroy(clip);
+		return false;
+	}
 
-	cairo_surface_t *t = (cairo_surface_t *)tex;
+	double off_x, off_y;
+	cairo_surface_get_device_offset(target, &off_x, &off_y);
+	int dx = x + (int)(m.x0 + off_x);
+	int dy = y + (int)(m.y0 + off_y);
+	int tw = cairo_image_surface_get_width(target);
+	int th = cairo_image_surface_get_height(target);
+	int dstStride = cairo_image_surface_get_stride(target);
+	int srcStride = cairo_image_surface_get_stride(surf);
+	uint8_t *dstData = cairo_image_surface_get_data(target);
+	uint8_t *srcData = cairo_image_surface_get_data(surf);
+
+	cairo_surface_flush(target);
+	for (int i = 0; i < clip->num_rectangles; i++) {
+		cairo_rectangle_t *c = &clip->rectangles[i];
+		int x0 = dx, y0 = dy;
+		int x1 = dx + src.w, y1 = dy + src.h;
+		int cx0 = c->x + m.x0 + off_x;
+		int cy0 = c->y + m.y0 + off_y;
+		int cx1 = cx0 + (int)c->width;
+		int cy1 = cy0 + (int)c->height;
+		if (x0 < cx0) x0 = cx0;
+		if (y0 < cy0) y0 = cy0;
+		if (x1 > cx1) x1 = cx1;
+		if (y1 > cy1) y1 = cy1;
+		if (x0 < 0) x0 = 0;
+		if (y0 < 0) y0 = 0;
+		if (x1 > tw) x1 = tw;
+		if (y1 > th) y1 = th;
+		if (x1 <= x0 || y1 <= y0)
+			continue;
 
-	if (src != NULL) {
-		t = cairo_surface_create_for_rectangle(t,
-				src->x, src->y, src->w, src->h);
+		int sx = src.x + x0 - dx;
+		int sy = src.y + y0 - dy;
+		if (opaque) {
+			blit_Copy(dstData + y0 * dstStride + x0 * 4, dstStride,
+					srcData + sy * srcStride + sx * 4, srcStride,
+					x1 - x0, y1 - y0);
+		} else {
+			blit_Over(dstData + y0 * dstStride + x0 * 4, dstStride,
+					srcData + sy * srcStride + sx * 4, srcStride,
+					x1 - x0, y1 - y0);
+		}
+		/* cairo applies the device offset to the rectangle itself */
+		cairo_surface_mark_dirty_rectangle(target, x0 - off_x, y0 - off_y,
+				x1 - x0, y1 - y0);
 	}
+	cairo_rectangle_list_destroy(clip);
+	return true;
+}
+
+static void
+drawSurface(cairo_t *cr, cairo_surface_t *surf, bool opaque,
+		struct game_Rect *dst)
+{
+	struct game_Rect src = {0, 0, dst->w, dst->h};
+	if (blitSurface(cr, surf, opaque, src, dst->x, dst->y))
+		return;
 
+	cairo_save(cr);
+	if (opaque)
+		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_surface(cr, surf, dst->x, dst->y);
+	cairo_rectangle(cr, dst->x, dst->y, dst->w, dst->h);
+	cairo_fill(cr);
+	cairo_restore(cr);
+}
+
+/* Draws the part src of the atlas texture tex, or all of it when src is
+ * NULL, at the position of dst. */
+static void
+drawTexture(cairo_t *cr, int tex, struct game_Rect *src, struct game_Rect *dst)
+{
+	struct game_Rect e = game.atlas.rects[tex];
+	struct game_Rect r = e;
+	int x = 0, y = 0;
 	if (dst != NULL) {
-		cairo_set_source_surface(cr, t, dst->x, dst->y);
-	} else {
-		// TODO: render to entire surface
-		cairo_set_source_surface(cr, t, 0, 0);
+		x = dst->x;
+		y = dst->y;
 	}
-	cairo_paint(cr);
-	if ((cairo_surface_t *)t != (cairo_surface_t *)tex) {
-		cairo_surface_destroy(t);
+	if (src != NULL) {
+		/* Never reach into the neighbours of the texture in the atlas */
+		int x0 = e.x + src->x, y0 = e.y + src->y;
+		int x1 = x0 + src->w, y1 = y0 + src->h;
+		if (x0 < e.x) {
+			x += e.x - x0;
+			x0 = e.x;
+		}
+		if (y0 < e.y) {
+			y += e.y - y0;
+			y0 = e.y;
+		}
+		if (x1 > e.x + e.w)
+			x1 = e.x + e.w;
+		if (y1 > e.y + e.h)
+			y1 = e.y + e.h;
+		if (x1 <= x0 || y1 <= y0)
+			return;
+		r = (struct game_Rect){x0, y0, x1 - x0, y1 - y0};
 	}
 
+	bool opaque = game.atlas.opaque[tex];
+	if (blitSurface(cr, game.atlas.surf, opaque, r, x, y))
+		return;
+
+	cairo_save(cr);
+	if (opaque)
+		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_surface(cr, game.atlas.surf, x - r.x, y - r.y);
+	cairo_rectangle(cr, x, y, r.w, r.h);
+	cairo_fill(cr);
 	cairo_restore(cr);
 }
 
 static void
-drawPlayer(int i, double x, double y, double w, double h, double cam_x, double cam_y)
+drawPlayer(cairo_t *cr, int i, double x, double y, double w, double h, double cam_x, double cam_y)
 {
 	struct game_Rect playRect = {
-		x + player[i].x - cam_x,
-		y + player[i].y - cam_y,
+		x + player[i].draw_x - cam_x,
+		y + player[i].draw_y - cam_y,
 		player[i].w,
 		player[i].h,
 	};
@@ -1105,15 +3290,11 @@ drawPlayer(int i, double x, double y, double w, double h, double cam_x, double c
 		return;
 	}
 
-	drawTrail(
-		playRect.x + playRect.w / 2,
-		playRect.y + playRect.h / 2,
-		x + player[i].trail.x - cam_x,
-		y + player[i].trail.y - cam_y,
-		playRect.w, player[i].trail.color);
+	drawTrail(cr, i, x - cam_x, y - cam_y, playRect.w);
 
 	/* Draw a black square in place of texture that failed to load */
-	if (*player[i].current == NULL) {
+	int texture = game.playerFrames[i][player[i].current];
+	if (texture < 0) {
 		if (playRect.x + playRect.w > x + w) {
 			playRect.w = x + w - playRect.x;
 		}
@@ -1121,139 +3302,60 @@ drawPlayer(int i, double x, double y, double w, double h, double cam_x, double c
 			playRect.w -= x - playRect.x;
 			playRect.x = playRect.x;
 		}
-		fillRect(GAME_RGB(0, 0, 0), &playRect);
+		fillRect(cr, GAME_RGB(0, 0, 0), &playRect);
 	} else {
 		struct game_Rect s = {
 			.x = 0,
-			.y = 0,
-			.w = player[i].w,
-			.h = player[i].h,
-		};
-		struct game_Rect p = playRect;
-		if (p.x + p.w > x + w) {
-			p.w = x + w - p.x;
-		}
-		if (p.x < x) {
-			p.w -= x - p.x;
-			p.x = x;
-		}
-
-		s.w = s.w * p.w / playRect.w;
-		s.x = p.x - playRect.x;
-
-		drawTexture(*player[i].current, &s, &p);
-	}
-
-	if (player[i].proj.active &&
-			player[i].proj.x - cam_x < w &&
-			player[i].proj.y - cam_y < h &&
-			player[i].proj.x - cam_x >= 0 &&
-			player[i].proj.y - cam_y >= 0) {
-		struct game_Rect projRect = {
-			x + player[i].proj.x - cam_x,
-			y + player[i].proj.y - cam_y,
-			PROJ_SIZE,
-			PROJ_SIZE,
-		};
-
-		// XXX: have a spinning animation?
-		fillRect(GAME_RGB(0XC8, 0XD6, 0XFF), &projRect);
-	}
-}
-
-static void
-drwPlayers(void)
-{
-	cairo_t *cr = game.cr;
-	for (int j = 0; j <= game.numplayers; j++) {
-		double cam_y = game.screens[j].cam_y;
-		double cam_x = game.screens[j].cam_x;
-		double x = game.screens[j].x;
-		double y = game.screens[j].y;
-		double w = game.screens[j].w;
-		double h = game.screens[j].h;
-
-		cairo_rectangle(cr, game.screens[j].x, game.screens[j].y,
-				game.screens[j].w, game.screens[j].h);
-		cairo_clip(cr);
-			for (int i = 0; i <= game.numplayers; i++) {
-				if (i == j) {
-					continue;
-				}
-				drawPlayer(i, x, y, w, h, cam_x, cam_y);
-			}
-			// TODO: change the camera so the player can always be seen.
-			drawPlayer(j, x, y, w, h, cam_x, cam_y);
-		cairo_reset_clip(cr);
-	}
-}
-
-static void
-drawPlatform(cairo_surface_t *t, struct game_Rect rect, struct game_Rect screen)
-{
-	for (int y = rect.y; y < rect.y + rect.h; y += BLOCK_SIZE) {
-		if (y + BLOCK_SIZE < 0 || y > screen.h) {
-			continue;
-		}
-		struct game_Rect d = rect;
-		d.h = BLOCK_SIZE;
-		if (y + d.h > screen.h) {
-			d.h = screen.h - y;
+			.y = 0,
+			.w = player[i].w,
+			.h = player[i].h,
+		};
+		struct game_Rect p = playRect;
+		if (p.x + p.w > x + w) {
+			p.w = x + w - p.x;
 		}
-		d.y = y + screen.y;
-		if (d.y < screen.y) {
-			d.h -= screen.y - d.y;
-			d.y = screen.y;
+		if (p.x < x) {
+			p.w -= x - p.x;
+			p.x = x;
 		}
-		for (int x = rect.x; x < rect.x + rect.w; x += BLOCK_SIZE) {
-			if (x + BLOCK_SIZE < 0 || x > screen.w) {
-				continue;
-			}
-			d.w = BLOCK_SIZE;
-			if (x + d.w > screen.w) {
-				d.w = screen.w - x;
-			}
-			d.x = x + screen.x;
-			if (d.x < screen.x) {
-				d.w -= screen.x - d.x;
-				d.x = screen.x;
-			}
 
-			struct game_Rect s = {
-				.x = 0,
-				.y = 0,
-				.w = d.w,
-				.h = d.h,
-			};
-			drawTexture(t, &s, &d);
-		}
+		s.w = s.w * p.w / playRect.w;
+		s.x = p.x - playRect.x;
+
+		drawTexture(cr, texture, &s, &p);
 	}
 }
 
 static void
-drwTiles(int j, struct Level *level)
+drwTiles(cairo_t *cr, int j, struct Level *level)
 {
 	double cam_y = game.screens[j].cam_y;
 	double cam_x = game.screens[j].cam_x;
-	for (size_t i = 0; i < level->regions_len; i++) {
-		struct game_Rect r = {
-			.x = level->regions[i].rect.x - cam_x,
-			.y = level->regions[i].rect.y - cam_y,
-			.w = level->regions[i].rect.w,
-			.h = level->regions[i].rect.h,
-		};
-		struct game_Rect dst = {
-			.x = game.screens[j].x,
-			.y = game.screens[j].y,
-			.w = game.screens[j].w,
-			.h = game.screens[j].h,
-		};
 
-		if (r.x > game.screens[j].w || r.y > game.screens[j].h) {
-			continue;
+	if (game.chunks.cols > 0) {
+		int c0, c1;
+		chunkColumns(cam_x, cam_x + game.screens[j].w, &c0, &c1);
+		int r0 = floorDiv((int)cam_y - game.chunks.y, CHUNK_SIZE);
+		int r1 = floorDiv((int)(cam_y + game.screens[j].h) - game.chunks.y, CHUNK_SIZE);
+		if (r0 < 0) r0 = 0;
+		if (r1 >= game.chunks.rows) r1 = game.chunks.rows - 1;
+
+		for (int row = r0; row <= r1; row++) {
+			for (int col = c0; col <= c1; col++) {
+				cairo_surface_t *t = game.chunks.surf[row * game.chunks.cols + col];
+				if (t == NULL)
+					continue;
+				struct game_Rect dst = {
+					.x = game.screens[j].x + (int)(game.chunks.x + col * CHUNK_SIZE - cam_x),
+					.y = game.screens[j].y + (int)(game.chunks.y + row * CHUNK_SIZE - cam_y),
+					.w = CHUNK_SIZE,
+					.h = CHUNK_SIZE,
+				};
+				drawSurface(cr, t,
+						game.chunks.opaque[row * game.chunks.cols + col],
+						&dst);
+			}
 		}
-
-		drawPlatform(level->regions[i].t, r, dst);
 	}
 
 	double x = game.screens[j].x;
@@ -1275,21 +3377,192 @@ drwTiles(int j, struct Level *level)
 		.h = BLOCK_SIZE,
 	};
 
-	drawTexture(endPointTexture, NULL, &dst);
+	if (endPointTexture >= 0)
+		drawTexture(cr, endPointTexture, NULL, &dst);
+}
+
+/* Screen rect of entity id in viewport j, where it's drawn this frame */
+static struct game_Rect
+entityRect(struct Entities *e, int id, int j)
+{
+	double alpha = game.alpha;
+	double x = e->prev_x[id] + (e->x[id] - e->prev_x[id]) * alpha;
+	double y = e->prev_y[id] + (e->y[id] - e->prev_y[id]) * alpha;
+	return (struct game_Rect){
+		.x = game.screens[j].x + (int)(x - game.screens[j].cam_x),
+		.y = game.screens[j].y + (int)(y - game.screens[j].cam_y),
+		.w = e->w[id],
+		.h = e->h[id],
+	};
+}
+
+static bool
+rectInViewport(struct game_Rect *r, int j)
+{
+	return r->x + r->w > game.screens[j].x &&
+		r->x < game.screens[j].x + game.screens[j].w &&
+		r->y + r->h > game.screens[j].y &&
+		r->y < game.screens[j].y + game.screens[j].h;
 }
 
 static void
-drwPlatforms(void)
+drwEntities(cairo_t *cr, struct Entities *e, int j)
 {
-	cairo_t *cr = game.cr;
-	struct Level *level = &game.levels[game.curLevel];
+	for (int i = 0; i < e->len; i++) {
+		if (!(e->flags[i] & ENTITY_ALIVE))
+			continue;
+		struct game_Rect dst = entityRect(e, i, j);
+		if (!rectInViewport(&dst, j))
+			continue;
+		switch (e->type[i]) {
+		case ENTITY_ENEMY:
+			if (enemyTexture >= 0) {
+				drawTexture(cr, enemyTexture, NULL, &dst);
+				break;
+			}
+			fillRect(cr, GAME_RGB(0xC8, 0x20, 0x20), &dst);
+			break;
+		case ENTITY_PROJECTILE:
+			// XXX: have a spinning animation?
+			fillRect(cr, GAME_RGB(0XC8, 0XD6, 0XFF), &dst);
+			break;
+		default:
+			fillRect(cr, GAME_RGB(0xC8, 0x20, 0x20), &dst);
+			break;
+		}
+	}
+}
+
+/* Draws everything in viewport j. The cairo context is already clipped to
+ * the viewport. */
+static void
+drwViewport(cairo_t *cr, int j)
+{
+	double cam_y = game.screens[j].cam_y;
+	double cam_x = game.screens[j].cam_x;
+	double x = game.screens[j].x;
+	double y = game.screens[j].y;
+	double w = game.screens[j].w;
+	double h = game.screens[j].h;
+
+	drwTiles(cr, j, &game.levels[game.curLevel]);
+	drwEntities(cr, &game.entities, j);
+
 	for (int i = 0; i <= game.numplayers; i++) {
-		cairo_rectangle(cr, game.screens[i].x, game.screens[i].y,
-				game.screens[i].w, game.screens[i].h);
-		cairo_clip(cr);
-			drwTiles(i, level);
-		cairo_reset_clip(cr);
+		if (i == j) {
+			continue;
+		}
+		drawPlayer(cr, i, x, y, w, h, cam_x, cam_y);
+	}
+	// TODO: change the camera so the player can always be seen.
+	drawPlayer(cr, j, x, y, w, h, cam_x, cam_y);
+	drwEntities(cr, &game.projectiles, j);
+}
+
+struct Viewport {
+	int j;
+	cairo_surface_t *surf;
+	cairo_t *cr;
+};
+
+static void
+drwViewportJob(void *arg)
+{
+	struct Viewport *vp = arg;
+	drwViewport(vp->cr, vp->j);
+}
+
+/* Viewports don't overlap, so with more than one of them each one is drawn
+ * on its own thread, into its own surface that shares the pixels of the
+ * part of the framebuffer covered by the viewport. */
+static void
+drwViewports(void)
+{
+	cairo_t *cr = game.cr;
+	cairo_surface_t *target = cairo_get_target(cr);
+
+	if (game.chunks.cols > 0)
+		bakeVisible();
+
+	bool parallel = game.numplayers > 0 &&
+		cairo_surface_get_type(target) == CAIRO_SURFACE_TYPE_IMAGE &&
+		cairo_image_surface_get_format(target) == CAIRO_FORMAT_ARGB32;
+	if (!parallel) {
+		for (int j = 0; j <= game.numplayers; j++) {
+			cairo_save(cr);
+			cairo_rectangle(cr, game.screens[j].x, game.screens[j].y,
+					game.screens[j].w, game.screens[j].h);
+			cairo_clip(cr);
+			drwViewport(cr, j);
+			cairo_restore(cr);
+		}
+		return;
+	}
+
+	cairo_surface_flush(target);
+	unsigned char *data = cairo_image_surface_get_data(target);
+	int stride = cairo_image_surface_get_stride(target);
+	int width = cairo_image_surface_get_width(target);
+	int height = cairo_image_surface_get_height(target);
+
+	/* The viewports are drawn with the transformation of cr, which
+	 * scales the game up when it's drawn at a fixed scale */
+	cairo_matrix_t m;
+	cairo_get_matrix(cr, &m);
+
+	struct Viewport vp[MAX_PLAYERS] = {0};
+	struct pool_Group group = {0};
+	for (int j = 0; j <= game.numplayers; j++) {
+		double ux0 = game.screens[j].x;
+		double uy0 = game.screens[j].y;
+		double ux1 = game.screens[j].x + game.screens[j].w;
+		double uy1 = game.screens[j].y + game.screens[j].h;
+		cairo_user_to_device(cr, &ux0, &uy0);
+		cairo_user_to_device(cr, &ux1, &uy1);
+		/* Neighbouring viewports share an edge, rounding both edges the
+		 * same way gives each pixel to only one of them since they're
+		 * drawn at the same time */
+		int x0 = floor(ux0 + 0.5);
+		int y0 = floor(uy0 + 0.5);
+		int x1 = floor(ux1 + 0.5);
+		int y1 = floor(uy1 + 0.5);
+		if (x0 < 0) x0 = 0;
+		if (y0 < 0) y0 = 0;
+		if (x1 > width) x1 = width;
+		if (y1 > height) y1 = height;
+		if (x1 <= x0 || y1 <= y0)
+			continue;
+
+		vp[j].j = j;
+		vp[j].surf = cairo_image_surface_create_for_data(
+				data + y0 * stride + x0 * 4, CAIRO_FORMAT_ARGB32,
+				x1 - x0, y1 - y0, stride);
+		vp[j].cr = cairo_create(vp[j].surf);
+		cairo_matrix_t vm = m;
+		vm.x0 -= x0;
+		vm.y0 -= y0;
+		cairo_set_matrix(vp[j].cr, &vm);
+		cairo_rectangle(vp[j].cr, game.screens[j].x, game.screens[j].y,
+				game.screens[j].w, game.screens[j].h);
+		cairo_clip(vp[j].cr);
+		for (int i = 0; i < game.damage.len; i++) {
+			struct game_Rect *r = &game.damage.rects[i];
+			cairo_rectangle(vp[j].cr, r->x, r->y, r->w, r->h);
+		}
+		cairo_clip(vp[j].cr);
+
+		pool_Submit(&group, drwViewportJob, &vp[j]);
+	}
+	pool_Wait(&group);
+
+	for (int j = 0; j <= game.numplayers; j++) {
+		if (vp[j].cr == NULL)
+			continue;
+		cairo_destroy(vp[j].cr);
+		cairo_surface_finish(vp[j].surf);
+		cairo_surface_destroy(vp[j].surf);
 	}
+	cairo_surface_mark_dirty(target);
 }
 
 static void
@@ -1302,13 +3575,210 @@ drawLine(struct game_Color c, int x1, int y1, int x2, int y2)
 	cairo_stroke(cr);
 }
 
+static void
+updateMenu(void)
+{
+	game.menuFocus += game.focusChange;
+	if (game.menuFocus < 0) game.menuFocus = 0;
+	if (game.menuFocus > 2) game.menuFocus = 2;
+	game.focusChange = 0;
+
+	if (game.focusSelect) {
+		switch (game.menuFocus) {
+		case 0:
+			game.state = STATE_LEVEL_SELECT;
+			break;
+		case 1:
+			if (game.numplayers >= MAX_PLAYERS-1)
+				game.numplayers = 0;
+			else
+				game.numplayers++;
+			break;
+		case 2:
+			game.running = false;
+			break;
+		}
+	}
+	game.focusSelect = 0;
+}
+
+static void
+addDamage(struct game_Damage *d, struct game_Rect r)
+{
+	if (r.x < 0) {
+		r.w += r.x;
+		r.x = 0;
+	}
+	if (r.y < 0) {
+		r.h += r.y;
+		r.y = 0;
+	}
+	if (r.x + r.w > game.w) r.w = game.w - r.x;
+	if (r.y + r.h > game.h) r.h = game.h - r.y;
+	if (r.w <= 0 || r.h <= 0)
+		return;
+
+	if (d->len < GAME_MAX_DAMAGE) {
+		d->rects[d->len++] = r;
+		return;
+	}
+
+	/* Out of space, merge everything into one rect */
+	int x0 = r.x, y0 = r.y, x1 = r.x + r.w, y1 = r.y + r.h;
+	for (int i = 0; i < d->len; i++) {
+		struct game_Rect *o = &d->rects[i];
+		if (o->x < x0) x0 = o->x;
+		if (o->y < y0) y0 = o->y;
+		if (o->x + o->w > x1) x1 = o->x + o->w;
+		if (o->y + o->h > y1) y1 = o->y + o->h;
+	}
+	d->rects[0] = (struct game_Rect){x0, y0, x1 - x0, y1 - y0};
+	d->len = 1;
+}
+
+/* Area covered by player i and its trail in viewport j */
+static bool
+playerBounds(int i, int j, struct game_Rect *r)
+{
+	double sx = game.screens[j].x - game.screens[j].cam_x;
+	double sy = game.screens[j].y - game.screens[j].cam_y;
+	int x0 = sx + player[i].draw_x;
+	int y0 = sy + player[i].draw_y;
+	int x1 = x0 + player[i].w;
+	int y1 = y0 + player[i].h;
+
+	for (int k = 0; k < TRAIL_LEN; k++) {
+		int tx = sx + player[i].trail.hist_x[k];
+		int ty = sy + player[i].trail.hist_y[k];
+		int r = player[i].w / 2 + 1;
+		if (tx - r < x0) x0 = tx - r;
+		if (ty - r < y0) y0 = ty - r;
+		if (tx + r > x1) x1 = tx + r;
+		if (ty + r > y1) y1 = ty + r;
+	}
+
+	/* Leave some space for antialiasing */
+	x0 -= 2; y0 -= 2; x1 += 2; y1 += 2;
+
+	if (x0 < game.screens[j].x) x0 = game.screens[j].x;
+	if (y0 < game.screens[j].y) y0 = game.screens[j].y;
+	if (x1 > game.screens[j].x + game.screens[j].w)
+		x1 = game.screens[j].x + game.screens[j].w;
+	if (y1 > game.screens[j].y + game.screens[j].h)
+		y1 = game.screens[j].y + game.screens[j].h;
+	if (x1 <= x0 || y1 <= y0)
+		return false;
+
+	*r = (struct game_Rect){x0, y0, x1 - x0, y1 - y0};
+	return true;
+}
+
+/* Marks where the entities of e are drawn in viewport j */
+static void
+entityDamage(struct Entities *e, int j, bool full)
+{
+	for (int i = 0; i < e->len; i++) {
+		if (!(e->flags[i] & ENTITY_ALIVE))
+			continue;
+		struct game_Rect r = entityRect(e, i, j);
+		if (!rectInViewport(&r, j))
+			continue;
+		addDamage(&game.drawn.dynamic, r);
+		if (!full)
+			addDamage(&game.damage, r);
+	}
+}
+
+static void
+computeDamage(int deathAlpha)
+{
+	struct game_Damage *d = &game.damage;
+	d->len = 0;
+
+	/* The bars were just painted over everything */
+	bool full = !game.drawn.valid ||
+		(game.scale > 0 && game.box.full) ||
+		game.drawn.target != game.target ||
+		game.drawn.state != game.state ||
+		game.drawn.menuFocus != game.menuFocus ||
+		game.drawn.numplayers != game.numplayers ||
+		game.drawn.curLevel != game.curLevel ||
+		game.drawn.deathAlpha != deathAlpha ||
+		game.drawn.w != game.w ||
+		game.drawn.h != game.h;
+	if (full)
+		addDamage(d, (struct game_Rect){0, 0, game.w, game.h});
+
+	if (game.state == STATE_PLAY) {
+		for (int j = 0; j <= game.numplayers && !full; j++) {
+			if (game.drawn.cam_x[j] != game.screens[j].cam_x ||
+					game.drawn.cam_y[j] != game.screens[j].cam_y) {
+				struct game_Rect r = {
+					game.screens[j].x,
+					game.screens[j].y,
+					game.screens[j].w,
+					game.screens[j].h,
+				};
+				addDamage(d, r);
+			}
+		}
+		for (int i = 0; i < game.drawn.dynamic.len && !full; i++) {
+			addDamage(d, game.drawn.dynamic.rects[i]);
+		}
+
+		game.drawn.dynamic.len = 0;
+		for (int j = 0; j <= game.numplayers; j++) {
+			for (int i = 0; i <= game.numplayers; i++) {
+				struct game_Rect r;
+				if (!playerBounds(i, j, &r))
+					continue;
+				addDamage(&game.drawn.dynamic, r);
+				if (!full)
+					addDamage(d, r);
+			}
+			entityDamage(&game.entities, j, full);
+			entityDamage(&game.projectiles, j, full);
+			game.drawn.cam_x[j] = game.screens[j].cam_x;
+			game.drawn.cam_y[j] = game.screens[j].cam_y;
+		}
+	}
+
+	game.drawn.valid = true;
+	game.drawn.target = game.target;
+	game.drawn.state = game.state;
+	game.drawn.menuFocus = game.menuFocus;
+	game.drawn.numplayers = game.numplayers;
+	game.drawn.curLevel = game.curLevel;
+	game.drawn.deathAlpha = deathAlpha;
+	game.drawn.w = game.w;
+	game.drawn.h = game.h;
+}
+
 void
 drw(void)
 {
 	static int death_alpha = 0;
 	if (game.state != STATE_DEAD) death_alpha = 0;
 
+	if (game.state == STATE_MENU)
+		updateMenu();
+	if (game.state == STATE_PLAY) {
+		interpolatePlayers(game.alpha);
+		moveCameras();
+	}
+
+	computeDamage(death_alpha);
+	if (game.damage.len == 0)
+		return;
+
 	cairo_t *cr = game.cr;
+	cairo_save(cr);
+	for (int i = 0; i < game.damage.len; i++) {
+		struct game_Rect *r = &game.damage.rects[i];
+		cairo_rectangle(cr, r->x, r->y, r->w, r->h);
+	}
+	cairo_clip(cr);
+
 	cairo_set_source_rgba(cr, 0, 0, 0, 1);
 	cairo_paint(cr);
 
@@ -1318,28 +3788,6 @@ drw(void)
 		int sectionSize = game.h / 4;
 		int sectionHeight = sectionSize - gaps * 2;
 		int sectionWidth = game.w - gaps * 2;
-		game.menuFocus += game.focusChange;
-		if (game.menuFocus < 0) game.menuFocus = 0;
-		if (game.menuFocus > 2) game.menuFocus = 2;
-		game.focusChange = 0;
-
-		if (game.focusSelect) {
-			switch (game.menuFocus) {
-			case 0:
-				game.state = STATE_LEVEL_SELECT;
-				break;
-			case 1:
-				if (game.numplayers >= MAX_PLAYERS-1)
-					game.numplayers = 0;
-				else
-					game.numplayers++;
-				break;
-			case 2:
-				game.running = false;
-				break;
-			}
-		}
-		game.focusSelect = 0;
 
 		drwHomeMenu(gaps, game.menuFocus,
 					sectionSize, sectionWidth, sectionHeight);
@@ -1374,9 +3822,9 @@ drw(void)
 				.h = box_h,
 			};
 			if (game.curLevel == i) {
-				fillRect(GAME_RGB(0x44, 0x55, 0xBB), &rect);
+				fillRect(cr, GAME_RGB(0x44, 0x55, 0xBB), &rect);
 			} else {
-				fillRect(GAME_RGB(0x11, 0x11, 0x66), &rect);
+				fillRect(cr, GAME_RGB(0x11, 0x11, 0x66), &rect);
 			}
 			rect = (struct game_Rect){
 				.x = rect.x + padding/2,
@@ -1384,22 +3832,27 @@ drw(void)
 				.w = inner_box_w,
 				.h = inner_box_h,
 			};
-			fillRect(GAME_RGB(0x01, 0x12, 0x44), &rect);
+			fillRect(cr, GAME_RGB(0x01, 0x12, 0x44), &rect);
 			drwText(buf, x + box_w/2, game.h/2, 40);
 		}
 	} break;
 	case STATE_PLAY: {
 		/* Change background to color: "#114261" */
-		fillRect(GAME_RGB(0x11, 0x41, 0x61), NULL);
-
-		movePlayers(game.dt);
+		fillRect(cr, GAME_RGB(0x11, 0x41, 0x61), NULL);
 
-		drwPlatforms();
-		drwPlayers();
+		drwViewports();
 
 		if (game.numplayers > 0 && split_screen) {
-			drawLine(GAME_BLACK, game.screens[0].w, game.screens[0].h,
-					game.screens[1].x, game.screens[1].y);
+			for (int j = 0; j <= game.numplayers; j++) {
+				int right = game.screens[j].x + game.screens[j].w;
+				int bottom = game.screens[j].y + game.screens[j].h;
+				if (right < game.w)
+					drawLine(GAME_BLACK, right, game.screens[j].y,
+							right, bottom);
+				if (bottom < game.h)
+					drawLine(GAME_BLACK, game.screens[j].x, bottom,
+							right, bottom);
+			}
 		}
 	} break;
 	case STATE_WON: {
@@ -1411,11 +3864,10 @@ drw(void)
 		// TODO: menu or at least keys to restart the level or go back
 		// to main menu
 		if (death_alpha < 255) {
-			fillRect(GAME_RGB(0x11, 0x41, 0x61), NULL);
-			drwPlatforms();
-			drwPlayers();
+			fillRect(cr, GAME_RGB(0x11, 0x41, 0x61), NULL);
+			drwViewports();
 
-			fillRect(GAME_RGBA(0, 0, 0, death_alpha), NULL);
+			fillRect(cr, GAME_RGBA(0, 0, 0, death_alpha), NULL);
 		}
 
 		drwTextScreenCentered("You died", 40);
@@ -1428,10 +3880,9 @@ drw(void)
 
 	} break;
 	case STATE_PAUSE: {
-		fillRect(GAME_RGB(0x11, 0x41, 0x61), NULL);
+		fillRect(cr, GAME_RGB(0x11, 0x41, 0x61), NULL);
 
-		drwPlatforms();
-		drwPlayers();
+		drwViewports();
 
 		// TODO: a pause menu
 		struct game_Rect r = {
@@ -1440,11 +3891,49 @@ drw(void)
 			.w = BLOCK_SIZE,
 			.h = BLOCK_SIZE*4,
 		};
-		fillRect(GAME_RGB(0x11, 0x11, 0x11), &r);
+		fillRect(cr, GAME_RGB(0x11, 0x11, 0x11), &r);
 		r.x = game.w / 2 + BLOCK_SIZE;
-		fillRect(GAME_RGB(0x11, 0x11, 0x11), &r);
+		fillRect(cr, GAME_RGB(0x11, 0x11, 0x11), &r);
 	} break;
 	}
+
+	cairo_restore(cr);
+}
+
+static void
+saveSnapshot(struct Snapshot *s)
+{
+	s->valid = true;
+	s->level = game.curLevel;
+	s->numplayers = game.numplayers;
+	memcpy(&s->sim, &sim, sizeof(sim));
+	for (int i = 0; i < MAX_PLAYERS; i++) {
+		s->cam_x[i] = game.screens[i].cam_x;
+		s->cam_y[i] = game.screens[i].cam_y;
+	}
+	entity_Copy(&s->entities, &game.entities);
+	entity_Copy(&s->projectiles, &game.projectiles);
+}
+
+/* Puts the level back the way it was when s was saved, without loading
+ * anything. Does nothing if s isn't a save of the level being played. */
+static void
+loadSnapshot(struct Snapshot *s)
+{
+	if (!s->valid || s->level != game.curLevel ||
+			s->numplayers != game.numplayers)
+		return;
+
+	memcpy(&sim, &s->sim, sizeof(sim));
+	for (int i = 0; i < MAX_PLAYERS; i++) {
+		game.screens[i].cam_x = s->cam_x[i];
+		game.screens[i].cam_y = s->cam_y[i];
+	}
+	entity_Copy(&game.entities, &s->entities);
+	entity_Copy(&game.projectiles, &s->projectiles);
+	game.state = STATE_PLAY;
+	game.accumulator = 0;
+	memset(game.tapped, 0, sizeof(game.tapped));
 }
 
 static void
@@ -1452,8 +3941,21 @@ handleKey(int sym)
 {
 	switch (game.state) {
 	case STATE_PLAY:
-		if (sym == KEY_PAUSE || sym == KEY_QUIT)
+		switch (sym) {
+		case KEY_PAUSE: /* FALLTHROUGH */
+		case KEY_QUIT:
 			game.state = STATE_PAUSE;
+			break;
+		case KEY_RESTART:
+			loadSnapshot(&game.start);
+			break;
+		case KEY_SAVE:
+			saveSnapshot(&game.quick);
+			break;
+		case KEY_LOAD:
+			loadSnapshot(&game.quick);
+			break;
+		}
 		break;
 	case STATE_MENU:
 		switch (sym) {
@@ -1492,9 +3994,7 @@ handleKey(int sym)
 			}
 			break;
 		case KEY_SELECT:
-			game.state = STATE_PLAY;
-			freePlayerTextures();
-			loadPlayerTextures();
+			game_StartLevel(game.curLevel, game.numplayers + 1);
 			break;
 		case KEY_QUIT:
 			game.state = STATE_MENU;
@@ -1519,6 +4019,12 @@ handleKey(int sym)
 		case KEY_PAUSE:
 			game.state = STATE_PLAY;
 			break;
+		case KEY_RESTART:
+			loadSnapshot(&game.start);
+			break;
+		case KEY_LOAD:
+			loadSnapshot(&game.quick);
+			break;
 		case KEY_SELECT:
 			game.focusSelect = true;
 			break;
@@ -1603,24 +4109,29 @@ game_Draw(double dt, int width, int height)
 	drw();
 }
 
+/* Handles the keys pressed and released this frame. Keys held down act on
+ * the players in game_Step instead. */
 static void
 game_Update(struct game_Input input, double dt, int width, int height)
 {
-	for (int player = 0; player < MAX_PLAYERS; player++) {
+	int players = input.players < MAX_PLAYERS ? input.players : MAX_PLAYERS;
+	for (int player = 0; player < players; player++) {
 		for (int i = 0; i < KEY_COUNT; i++) {
 			switch (input.keys[player][i]) {
 			case KEY_UNKNOWN:
 				break;
 			case KEY_PRESSED:
 				handleKey(i);
+				game.held[player][i] = true;
 				if (game.state == STATE_PLAY) {
-					handleKeyRepeat(i, player);
+					game.tapped[player][i] = true;
 				}
 				break;
 			case KEY_PRESSED_REPEAT:
-				handleKeyRepeat(i, player);
+				game.held[player][i] = true;
 				break;
 			case KEY_RELEASED:
+				game.held[player][i] = false;
 				handleKeyRelease(i, player);
 				break;
 			}
@@ -1628,15 +4139,220 @@ game_Update(struct game_Input input, double dt, int width, int height)
 	}
 }
 
+/* Advances the simulation by one tick */
+static void
+game_Step(void)
+{
+	for (int i = 0; i <= game.numplayers; i++) {
+		player[i].prev_x = player[i].x;
+		player[i].prev_y = player[i].y;
+	}
+
+	for (int player = 0; player < MAX_PLAYERS; player++) {
+		for (int i = 0; i < KEY_COUNT; i++) {
+			if (game.held[player][i] || game.tapped[player][i])
+				handleKeyRepeat(i, player);
+			game.tapped[player][i] = false;
+		}
+	}
+
+	movePlayers(game.tick);
+	moveEntities(game.tick);
+	if (game.state == STATE_PLAY)
+		collideBodies();
+	moveProjectiles(game.tick);
+	sim.ticks++;
+}
+
+/* Runs as many ticks as fit in the time since the last frame */
+static void
+game_Advance(double dt)
+{
+	if (game.state != STATE_PLAY) {
+		game.accumulator = 0;
+		return;
+	}
+
+	if (dt > MAX_FRAME_TIME)
+		dt = MAX_FRAME_TIME;
+	game.accumulator += dt;
+	while (game.accumulator >= game.tick && game.state == STATE_PLAY) {
+		game_Step();
+		game.accumulator -= game.tick;
+	}
+	game.alpha = game.accumulator / game.tick;
+}
+
+/* Starts level (counting from 0) with numplayers players, skipping the
+ * menus. Returns false if there's no such level. */
+bool
+game_StartLevel(int level, int numplayers)
+{
+	if (level < 0 || level >= game.levels_len)
+		return false;
+	/* Set before the level is locked, a prefetch of it that's running
+	 * finishes first and queued ones are skipped */
+	atomic_store(&game.prefetchTarget, level + 1);
+	if (!ensureLevel(&game.levels[level]))
+		return false;
+	if (numplayers < 1) numplayers = 1;
+	if (numplayers > MAX_PLAYERS) numplayers = MAX_PLAYERS;
+
+	game.curLevel = level;
+	game.numplayers = numplayers - 1;
+	game.state = STATE_PLAY;
+	game.accumulator = 0;
+	sim.ticks = 0;
+	memset(game.held, 0, sizeof(game.held));
+	memset(game.tapped, 0, sizeof(game.tapped));
+	resetPlayers();
+	spawnEntities(&game.levels[level]);
+	stage_length = game.levels[level].stage_length;
+	if (!game.headless)
+		bakeLevel(&game.levels[level]);
+	saveSnapshot(&game.start);
+	game.quick.valid = false;
+
+	/* Only this level and the next one are kept parsed */
+	for (int i = 0; i < game.levels_len; i++) {
+		if (i == level || i == level + 1)
+			continue;
+		if (pthread_mutex_trylock(&game.levels[i].lock) != 0)
+			continue;
+		if (game.levels[i].loaded)
+			unloadLevel(&game.levels[i]);
+		pthread_mutex_unlock(&game.levels[i].lock);
+	}
+	if (level + 1 < game.levels_len)
+		pool_Submit(&game.prefetch, prefetchLevel, &game.levels[level + 1]);
+	return true;
+}
+
+static void updateFrame(struct game_Input input, double dt, int width,
+		int height);
+
+/* Handles the input of a frame and runs the ticks that fit in dt, without
+ * drawing. Returns false once the level isn't being played anymore. */
+bool
+game_Frame(double dt, struct game_Input input)
+{
+	updateFrame(input, dt, game.w, game.h);
+	return game.state == STATE_PLAY || game.state == STATE_PAUSE;
+}
+
+/* Handles input and runs exactly one tick, without drawing. Returns false
+ * once the level isn't being played anymore. */
+bool
+game_Tick(struct game_Input input)
+{
+	game_Update(input, game.tick, game.w, game.h);
+	if (game.state == STATE_PLAY)
+		game_Step();
+	return game.state == STATE_PLAY;
+}
+
+enum game_Result
+game_Result(void)
+{
+	switch (game.state) {
+	case STATE_WON:
+		return GAME_WON;
+	case STATE_DEAD:
+		return GAME_LOST;
+	default:
+		return GAME_PLAYING;
+	}
+}
+
+long
+game_Ticks(void)
+{
+	return sim.ticks;
+}
+
+void
+game_PlayerPosition(int i, double *x, double *y)
+{
+	*x = player[i].x;
+	*y = player[i].y;
+}
+
+/* Writes the frame to the recording, starting a new one when a level was
+ * just picked. The keys of that frame up to the one that picked the level
+ * went to the level select menu, so only the ones the level got after it
+ * are recorded, as what they left in held and tapped. */
+static void
+record(enum GameState prev, double dt, struct game_Input *input)
+{
+	if (prev == STATE_LEVEL_SELECT && game.state == STATE_PLAY) {
+		replay_Close(&game.record);
+		struct replay_Header header = {
+			.level = game.curLevel + 1,
+			.numplayers = game.numplayers + 1,
+			.tickRate = game.tickRate,
+			.build = VERSION,
+		};
+		if (!replay_Create(&game.record, game.recordPath, &header)) {
+			game.recordPath = NULL;
+			return;
+		}
+		KeyState keys[MAX_PLAYERS][KEY_COUNT] = {0};
+		for (int p = 0; p < MAX_PLAYERS; p++) {
+			for (int k = 0; k < KEY_COUNT; k++) {
+				if (game.tapped[p][k])
+					keys[p][k] = KEY_PRESSED;
+				else if (game.held[p][k])
+					keys[p][k] = KEY_PRESSED_REPEAT;
+			}
+		}
+		struct game_Input got = {.keys = keys, .players = MAX_PLAYERS};
+		replay_Write(&game.record, dt, &got);
+	} else if (game.record.f != NULL) {
+		replay_Write(&game.record, dt, input);
+	}
+}
+
+/* Handles the input of a frame, recording it if asked to, and runs the
+ * ticks that fit in dt */
+static void
+updateFrame(struct game_Input input, double dt, int width, int height)
+{
+	enum GameState prev = game.state;
+	game_Update(input, dt, width, height);
+	if (game.recordPath != NULL)
+		record(prev, dt, &input);
+	game_Advance(dt);
+	if (game.record.f != NULL && game.state != STATE_PLAY &&
+			game.state != STATE_PAUSE) {
+		replay_Close(&game.record);
+	}
+}
+
 bool
-game_UpdateAndDraw(cairo_t *cr, double dt, struct game_Input input, int width, int height)
+game_UpdateAndDraw(cairo_t *cr, double dt, struct game_Input input,
+		int width, int height, struct game_Damage *damage)
 {
 	game.cr = cr;
+	cairo_save(cr);
 	cairo_set_font_face(cr, game.font_face);
 
+	/* The game is drawn the same at any fixed scale, only sharper */
+	if (game.scale > 0) {
+		letterbox(cr, width, height);
+		width = LOGICAL_WIDTH;
+		height = LOGICAL_HEIGHT;
+	}
+
 	resize_screens(width, height);
+	resizeTextCache(width, height);
 
-	game_Update(input, dt, width, height);
+	updateFrame(input, dt, width, height);
 	game_Draw(dt, width, height);
+	cairo_restore(cr);
+	if (damage) {
+		*damage = game.damage;
+		if (game.scale > 0)
+			letterboxDamage(damage);
+	}
 	return game.running;
 }
@@ -1,7 +1,7 @@
 #ifndef _GAME_H_
 #define _GAME_H_
 
-#define MAX_PLAYERS 2
+#define MAX_PLAYERS 8
 
 #ifndef GAME_DATA_DIR
 #define GAME_DATA_DIR "./data"
@@ -9,15 +9,34 @@
 
 #define GRAVITY 98.0f
 #define TERMINAL_VELOCITY (GRAVITY * 1.2)
+/* Added to dy for each 1/60 s the jump key is held */
 #define JUMP_ACCEL 8
-#define SPEED_ACCEL 400.0f
+/* Horizontal speeds are in pixels per second */
+#define SPEED_ACCEL 2100.0f
 #define SPEED_MAX 800
+/* Part of the horizontal speed kept after each 1/60 s */
 #define FRICTION 0.91f
 #define PROJ_DX 380.0f
 #define PROJ_RET 500
 #define PROJ_SIZE 12
+#define PROJ_COOLDOWN 0.25f
+#define ENEMY_SPEED 60.0f
+#define ENEMY_SIZE BLOCK_SIZE
+/* How fast a player bounces up off an enemy they stomp on */
+#define STOMP_BOUNCE (JUMP_ACCEL * 1.5f)
+
+/* Simulation ticks per second */
+#ifndef TICK_RATE
+#define TICK_RATE 120
+#endif
 
 #define FRAME_NUM 3
+/* Places a player's sprites are looked for in, see playerPaths */
+#define PLAYER_PATHS 3
+
+/* Relative to GAME_DATA_DIR */
+#define FONT_FILE "fonts/FreeSerifBoldItalic.ttf"
+#define PACK_FILE "fuyunix.pack"
 
 #define BLOCK_SIZE 32
 #define PLAYER_SIZE BLOCK_SIZE
@@ -36,6 +55,9 @@ typedef enum {
 	KEY_PAUSE,
 	KEY_QUIT,
 	KEY_SHOOT,
+	KEY_RESTART,
+	KEY_SAVE,
+	KEY_LOAD,
 
 	/* KEY_SELECT key isn't configurable */
 	KEY_SELECT,
@@ -55,8 +77,11 @@ typedef enum {
 	CURSOR_COUNT,
 } Cursor;
 
+/* keys[player][key] for each of the players the platform has keys for.
+ * Keys of players that aren't playing act on the first player. */
 struct game_Input {
-	KeyState keys [2][KEY_COUNT];
+	KeyState (*keys)[KEY_COUNT];
+	int players;
 	int ptr_x;
 	int ptr_y;
 };
@@ -75,16 +100,47 @@ struct game_Color {
 	uint8_t r, g, b, a;
 };
 
+#define GAME_MAX_DAMAGE 16
+
+/* Parts of the framebuffer changed by the last call to game_UpdateAndDraw */
+struct game_Damage {
+	struct game_Rect rects[GAME_MAX_DAMAGE];
+	int len;
+};
+
 struct game_Data {
 	int level;
 };
 
+enum game_Result {
+	GAME_PLAYING,
+	GAME_WON,
+	GAME_LOST,
+};
+
 #define GAME_RGBA(r, g, b, a) (struct game_Color){r, g, b, a}
 #define GAME_RGB(r, g, b) (struct game_Color){r, g, b, 0xFF}
 #define GAME_BLACK (struct game_Color){0, 0, 0, 0xFF}
 
+void game_SetScale(int scale);
+void game_SetTickRate(int rate);
+void game_RecordTo(char *path);
+void game_RenderSize(int width, int height, int *rw, int *rh);
+void game_NewTarget(void);
 void game_Init(void);
-bool game_UpdateAndDraw(cairo_t *cr, double dt, struct game_Input input, int width, int height);
+bool game_UpdateAndDraw(cairo_t *cr, double dt, struct game_Input input,
+		int width, int height, struct game_Damage *damage);
 void game_Quit(void);
 
+/* Running levels without drawing them */
+void game_InitHeadless(void);
+int game_CompileLevels(char *dir);
+int game_Pack(char *dir);
+bool game_StartLevel(int level, int numplayers);
+bool game_Frame(double dt, struct game_Input input);
+bool game_Tick(struct game_Input input);
+enum game_Result game_Result(void);
+long game_Ticks(void);
+void game_PlayerPosition(int i, double *x, double *y);
+
 #endif /* _GAME_H_ */
@@ -0,0 +1,237 @@
+/*
+ *  Copyright 2021 Shaqeel Ahmad
+ *
+ *  This file is part of fuyunix.
+ *
+ *  fuyunix is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fuyunix is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fuyunix.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A script is an scfg file made of these directives:
+ *
+ *	players 2        players in the levels started after it
+ *	level 3          start level 3, finishing the one before
+ *	ticks 120 {      run 120 ticks with these keys held down,
+ *		right 1      as key name and player
+ *		up 2
+ *	}
+ *
+ * A ticks directive without a block runs with no keys held. The result of
+ * each level is printed on a line of its own.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <cairo.h>
+
+#include "fuyunix.h"
+#include "game.h"
+#include "headless.h"
+#include "replay.h"
+#include "scfg.h"
+
+struct Run {
+	int level;
+	int numplayers;
+	bool started;
+	bool over;
+
+	bool held[MAX_PLAYERS][KEY_COUNT];
+};
+
+static void
+report(int level, int numplayers)
+{
+	char *result = "playing";
+	switch (game_Result()) {
+	case GAME_WON:
+		result = "won";
+		break;
+	case GAME_LOST:
+		result = "lost";
+		break;
+	case GAME_PLAYING:
+		break;
+	}
+	printf("level %d: %s after %ld ticks", level, result, game_Ticks());
+	/* Exact enough to tell if a change to the physics changed anything */
+	for (int i = 0; i < numplayers; i++) {
+		double x, y;
+		game_PlayerPosition(i, &x, &y);
+		printf(" %.17g,%.17g", x, y);
+	}
+	putchar('\n');
+}
+
+/* Runs ticks ticks with the keys in held down, turning them into the
+ * presses and releases the platforms would send. */
+static void
+runTicks(struct Run *run, long ticks, bool held[MAX_PLAYERS][KEY_COUNT])
+{
+	for (long t = 0; t < ticks && !run->over; t++) {
+		KeyState keys[MAX_PLAYERS][KEY_COUNT] = {0};
+		struct game_Input input = {.keys = keys, .players = MAX_PLAYERS};
+		for (int p = 0; p < MAX_PLAYERS; p++) {
+			for (int k = 0; k < KEY_COUNT; k++) {
+				if (held[p][k])
+					input.keys[p][k] = run->held[p][k] ?
+						KEY_PRESSED_REPEAT : KEY_PRESSED;
+				else if (run->held[p][k])
+					input.keys[p][k] = KEY_RELEASED;
+				run->held[p][k] = held[p][k];
+			}
+		}
+		run->over = !game_Tick(input);
+	}
+}
+
+int
+headless_Run(char *script, int (*keyFromName)(char *name))
+{
+	struct scfg_block block;
+	if (scfg_load_file(&block, script) < 0) {
+		perror(script);
+		return 1;
+	}
+
+	game_InitHeadless();
+
+	struct Run run = {
+		.numplayers = 1,
+	};
+	int status = 0;
+	for (size_t i = 0; i < block.directives_len && status == 0; i++) {
+		struct scfg_directive *d = &block.directives[i];
+		if (strcmp(d->name, "players") == 0 && d->params_len == 1) {
+			run.numplayers = atoi(d->params[0]);
+			if (run.numplayers < 1 || run.numplayers > MAX_PLAYERS) {
+				fprintf(stderr, "%s:%d: Invalid number of players %s\n",
+						script, d->lineno, d->params[0]);
+				status = 1;
+			}
+		} else if (strcmp(d->name, "level") == 0 && d->params_len == 1) {
+			if (run.started)
+				report(run.level, run.numplayers);
+			run = (struct Run){
+				.level = atoi(d->params[0]),
+				.numplayers = run.numplayers,
+				.started = true,
+			};
+			if (!game_StartLevel(run.level - 1, run.numplayers)) {
+				fprintf(stderr, "%s:%d: No level %s\n",
+						script, d->lineno, d->params[0]);
+				status = 1;
+			}
+		} else if (strcmp(d->name, "ticks") == 0 && d->params_len == 1) {
+			if (!run.started) {
+				fprintf(stderr, "%s:%d: ticks before any level\n",
+						script, d->lineno);
+				status = 1;
+				break;
+			}
+			bool held[MAX_PLAYERS][KEY_COUNT] = {0};
+			struct scfg_block *child = &d->children;
+			for (size_t j = 0; j < child->directives_len; j++) {
+				struct scfg_directive *k = &child->directives[j];
+				int sym = keyFromName(k->name);
+				int p = k->params_len == 1 ? atoi(k->params[0]) : 0;
+				if (sym < 0 || p < 1 || p > MAX_PLAYERS) {
+					fprintf(stderr, "%s:%d: Invalid key %s\n",
+							script, k->lineno, k->name);
+					status = 1;
+					break;
+				}
+				held[p-1][sym] = true;
+			}
+			if (status == 0)
+				runTicks(&run, atol(d->params[0]), held);
+		} else {
+			fprintf(stderr, "%s:%d: Invalid directive %s\n",
+					script, d->lineno, d->name);
+			status = 1;
+		}
+	}
+	if (status == 0 && run.started)
+		report(run.level, run.numplayers);
+
+	scfg_block_finish(&block);
+	game_Quit();
+
+	return status;
+}
+
+int
+headless_Replay(char *path, bool draw)
+{
+	struct Replay r;
+	if (!replay_Open(&r, path))
+		return 1;
+	if (strcmp(r.header.build, VERSION) != 0) {
+		fprintf(stderr, "%s: recorded with %s, results may differ\n",
+				path, r.header.build);
+	}
+	game_SetTickRate(r.header.tickRate);
+
+	cairo_surface_t *surf = NULL;
+	cairo_t *cr = NULL;
+	int width, height;
+	game_RenderSize(LOGICAL_WIDTH, LOGICAL_HEIGHT, &width, &height);
+	if (draw) {
+		game_Init();
+		surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+		cr = cairo_create(surf);
+	} else {
+		game_InitHeadless();
+	}
+
+	int status = 0;
+	if (!game_StartLevel(r.header.level - 1, r.header.numplayers)) {
+		fprintf(stderr, "%s: no level %d\n", path, r.header.level);
+		status = 1;
+		goto out;
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	long frames = 0;
+	double dt;
+	struct game_Input input;
+	while (replay_Read(&r, &dt, &input)) {
+		if (draw)
+			game_UpdateAndDraw(cr, dt, input, width, height, NULL);
+		else
+			game_Frame(dt, input);
+		frames++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	report(r.header.level, r.header.numplayers);
+	double secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%ld frames in %.3fs\n", frames, secs);
+
+out:
+	if (cr != NULL) {
+		cairo_destroy(cr);
+		cairo_surface_destroy(surf);
+	}
+	replay_Close(&r);
+	game_Quit();
+	return status;
+}
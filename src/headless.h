@@ -0,0 +1,18 @@
+#ifndef _HEADLESS_H_
+#define _HEADLESS_H_
+
+/*
+ * Plays levels from a script without opening a window, as fast as the
+ * simulation runs. keyFromName maps the key names used in the config file
+ * to game keys. Returns the exit status for the program.
+ */
+int headless_Run(char *script, int (*keyFromName)(char *name));
+
+/*
+ * Plays back a recording made with game_RecordTo as fast as possible,
+ * drawing every frame into an image in memory if draw is set, and prints
+ * the result and how long it took.
+ */
+int headless_Replay(char *path, bool draw);
+
+#endif /* _HEADLESS_H_ */
@@ -0,0 +1,227 @@
+/*
+ *  Copyright 2021 Shaqeel Ahmad
+ *
+ *  This file is part of fuyunix.
+ *
+ *  fuyunix is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fuyunix is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fuyunix.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pack.h"
+#include "util.h"
+
+#define PACK_MAGIC "FYPK"
+#define PACK_FORMAT 2
+
+struct pack_Header {
+	char magic[4];
+	uint32_t format;
+	uint32_t count;
+	uint32_t reserved;
+};
+
+static uint64_t
+alignUp(uint64_t n)
+{
+	return (n + PACK_ALIGN - 1) / PACK_ALIGN * PACK_ALIGN;
+}
+
+/* Maps the pack at path. Returns false if there's none or it's not one
+ * this build can read. */
+bool
+pack_Open(struct Pack *p, const char *path)
+{
+	*p = (struct Pack){0};
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct pack_Header)) {
+		close(fd);
+		return false;
+	}
+	size_t len = st.st_size;
+	/* Private and writable so the pixels can be handed to cairo, pages are
+	 * only copied if something writes to them */
+	char *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	const struct pack_Header *h = (const struct pack_Header *)map;
+	if (memcmp(h->magic, PACK_MAGIC, 4) != 0 || h->format != PACK_FORMAT ||
+			h->count > (len - sizeof(*h)) / sizeof(struct pack_Entry)) {
+		fprintf(stderr, "%s: unsupported pack format\n", path);
+		munmap(map, len);
+		return false;
+	}
+	const struct pack_Entry *entries =
+		(const struct pack_Entry *)(map + sizeof(*h));
+	for (uint32_t i = 0; i < h->count; i++) {
+		if (entries[i].offset > len || entries[i].size > len - entries[i].offset ||
+				entries[i].offset % PACK_ALIGN != 0 ||
+				entries[i].kind > PACK_LEVEL ||
+				entries[i].name[PACK_NAME_LEN - 1] != '\0') {
+			fprintf(stderr, "%s: corrupt pack\n", path);
+			munmap(map, len);
+			return false;
+		}
+	}
+
+	p->map = map;
+	p->len = len;
+	p->entries = entries;
+	p->count = h->count;
+	return true;
+}
+
+static int
+compareEntry(const void *key, const void *e)
+{
+	return strcmp(key, ((const struct pack_Entry *)e)->name);
+}
+
+/* Returns the entry called name, or NULL */
+const struct pack_Entry *
+pack_Find(struct Pack *p, const char *name)
+{
+	if (p->map == NULL)
+		return NULL;
+	return bsearch(name, p->entries, p->count, sizeof(*p->entries),
+			compareEntry);
+}
+
+void *
+pack_Data(struct Pack *p, const struct pack_Entry *e)
+{
+	return p->map + e->offset;
+}
+
+void
+pack_Close(struct Pack *p)
+{
+	if (p->map != NULL)
+		munmap(p->map, p->len);
+	*p = (struct Pack){0};
+}
+
+void
+pack_Create(struct pack_Writer *w, const char *path)
+{
+	*w = (struct pack_Writer){0};
+	w->path = ecalloc(strlen(path) + 1, 1);
+	strcpy(w->path, path);
+}
+
+/* Adds an entry described by e with e->size bytes of data, the data is
+ * copied */
+bool
+pack_Add(struct pack_Writer *w, const struct pack_Entry *e, const void *data)
+{
+	if (strlen(e->name) >= PACK_NAME_LEN) {
+		fprintf(stderr, "%s: name too long for a pack\n", e->name);
+		return false;
+	}
+	w->entries = erealloc(w->entries, (w->count + 1) * sizeof(*w->entries));
+	w->data = erealloc(w->data, (w->count + 1) * sizeof(*w->data));
+	w->entries[w->count] = *e;
+	w->data[w->count] = ecalloc(e->size ? e->size : 1, 1);
+	memcpy(w->data[w->count], data, e->size);
+	w->count++;
+	return true;
+}
+
+static struct pack_Writer *sortWriter;
+
+static int
+compareIndex(const void *a, const void *b)
+{
+	return strcmp(sortWriter->entries[*(const uint32_t *)a].name,
+			sortWriter->entries[*(const uint32_t *)b].name);
+}
+
+/* Writes the pack and frees the writer. The pack is written to a
+ * temporary file first as the old one may be mapped. */
+bool
+pack_Finish(struct pack_Writer *w)
+{
+	uint32_t *order = ecalloc(w->count ? w->count : 1, sizeof(*order));
+	for (uint32_t i = 0; i < w->count; i++)
+		order[i] = i;
+	sortWriter = w;
+	qsort(order, w->count, sizeof(*order), compareIndex);
+	sortWriter = NULL;
+
+	struct pack_Entry *index = ecalloc(w->count ? w->count : 1, sizeof(*index));
+	uint64_t off = alignUp(sizeof(struct pack_Header) +
+			(uint64_t)w->count * sizeof(*index));
+	for (uint32_t i = 0; i < w->count; i++) {
+		index[i] = w->entries[order[i]];
+		index[i].offset = off;
+		off = alignUp(off + index[i].size);
+	}
+
+	char tmp[PATH_MAX];
+	bool ok = snprintf(tmp, sizeof(tmp), "%s.tmp", w->path) < (int)sizeof(tmp);
+	FILE *f = ok ? fopen(tmp, "wb") : NULL;
+	if (f == NULL) {
+		perror(w->path);
+		ok = false;
+	} else {
+		struct pack_Header h = {.format = PACK_FORMAT, .count = w->count};
+		memcpy(h.magic, PACK_MAGIC, 4);
+		fwrite(&h, sizeof(h), 1, f);
+		fwrite(index, sizeof(*index), w->count, f);
+		for (uint32_t i = 0; i < w->count; i++) {
+			while ((uint64_t)ftell(f) < index[i].offset)
+				fputc(0, f);
+			fwrite(w->data[order[i]], 1, index[i].size, f);
+		}
+		ok = !ferror(f);
+		if (fclose(f) != 0)
+			ok = false;
+		if (!ok || rename(tmp, w->path) < 0) {
+			perror(w->path);
+			remove(tmp);
+			ok = false;
+		}
+	}
+
+	free(index);
+	free(order);
+	pack_Discard(w);
+	return ok;
+}
+
+/* Frees the writer without writing anything */
+void
+pack_Discard(struct pack_Writer *w)
+{
+	for (uint32_t i = 0; i < w->count; i++)
+		free(w->data[i]);
+	free(w->data);
+	free(w->entries);
+	free(w->path);
+	*w = (struct pack_Writer){0};
+}
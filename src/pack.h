@@ -0,0 +1,65 @@
+#ifndef _PACK_H_
+#define _PACK_H_
+
+/*
+ * A single file holding the game data ready to be used from memory: images
+ * as pixels in the cairo format they're drawn from, compiled levels and
+ * raw files like the font. Entries are named by their path under the data
+ * directory and sorted by name. The file is mapped and entries are used in
+ * place. Each entry records the mtime and size of the file it was made
+ * from so it can be skipped once that file has changed.
+ *
+ *	header  "FYPK" u32 format u32 count u32 0
+ *	index   count struct pack_Entry
+ *	data    each entry at a multiple of PACK_ALIGN
+ */
+
+#define PACK_NAME_LEN 56
+#define PACK_ALIGN 64
+
+enum pack_Kind {
+	PACK_RAW,
+	PACK_IMAGE,
+	PACK_LEVEL,
+};
+
+struct pack_Entry {
+	char name[PACK_NAME_LEN];
+	uint32_t kind;
+	/* For images, the cairo_format_t and size of the pixels */
+	int32_t format;
+	int32_t width;
+	int32_t height;
+	int32_t stride;
+	uint32_t reserved;
+	int64_t mtime;
+	int64_t source_size;
+	uint64_t offset;
+	uint64_t size;
+};
+
+struct Pack {
+	char *map;
+	size_t len;
+	const struct pack_Entry *entries;
+	uint32_t count;
+};
+
+struct pack_Writer {
+	char *path;
+	struct pack_Entry *entries;
+	void **data;
+	uint32_t count;
+};
+
+bool pack_Open(struct Pack *p, const char *path);
+const struct pack_Entry *pack_Find(struct Pack *p, const char *name);
+void *pack_Data(struct Pack *p, const struct pack_Entry *e);
+void pack_Close(struct Pack *p);
+
+void pack_Create(struct pack_Writer *w, const char *path);
+bool pack_Add(struct pack_Writer *w, const struct pack_Entry *e, const void *data);
+bool pack_Finish(struct pack_Writer *w);
+void pack_Discard(struct pack_Writer *w);
+
+#endif /* _PACK_H_ */
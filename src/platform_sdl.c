@@ -25,8 +25,10 @@
 #include <limits.h>
 #include <unistd.h>
 
+#include "blit.h"
 #include "fuyunix.h"
 #include "game.h"
+#include "headless.h"
 #include "scfg.h"
 #include "util.h"
 
@@ -86,7 +88,7 @@ static struct {
 	int is_key_allocated;
 } keys;
 
-_Static_assert(KEY_COUNT == 8, "Update keyList");
+_Static_assert(KEY_COUNT == 11, "Update keyList");
 
 static char *keysList[] = {
 	[KEY_UP]     = "up",
@@ -96,6 +98,9 @@ static char *keysList[] = {
 	[KEY_PAUSE]  = "pause",
 	[KEY_SHOOT]  = "shoot",
 	[KEY_QUIT]   = "quit",
+	[KEY_RESTART] = "restart",
+	[KEY_SAVE]   = "save",
+	[KEY_LOAD]   = "load",
 };
 
 static int
@@ -181,7 +186,7 @@ loadConfig(void)
 					exit(1);
 				}
 				int player = atoi(d->params[1]);
-				if (player <= 0) {
+				if (player <= 0 || player > MAX_PLAYERS) {
 					fprintf(stderr, "%s:%d: Invalid number %s\n",
 							filepath, d->lineno, d->params[1]);
 					exit(1);
@@ -220,6 +225,18 @@ listFunc(void)
 		printf("%s\n", keysList[i]);
 }
 
+/* Number of players that have keys */
+static int
+keyPlayers(void)
+{
+	int players = 1;
+	for (int i = 0; i < keys.keylen; i++) {
+		if (keys.key[i].player >= players)
+			players = keys.key[i].player + 1;
+	}
+	return players;
+}
+
 int
 gameKey(SDL_Scancode code, int *p)
 {
@@ -243,6 +260,12 @@ gameKey(SDL_Scancode code, int *p)
 		return KEY_QUIT;
 	case SDL_SCANCODE_ESCAPE:
 		return KEY_PAUSE;
+	case SDL_SCANCODE_R:
+		return KEY_RESTART;
+	case SDL_SCANCODE_F5:
+		return KEY_SAVE;
+	case SDL_SCANCODE_F9:
+		return KEY_LOAD;
 	case SDL_SCANCODE_RETURN: // fallthrough
 	case SDL_SCANCODE_SPACE:
 		return KEY_SELECT;
@@ -257,10 +280,12 @@ run(void)
 	SDL_Event event;
 	uint32_t t = SDL_GetTicks();
 	struct game_Input input = {0};
+	input.players = keyPlayers();
+	input.keys = ecalloc(input.players, sizeof(*input.keys));
 	while (true) {
 		while (SDL_PollEvent(&event) != 0) {
 			if (event.type == SDL_QUIT)
-				return;
+				goto out;
 
 			int player = 0;
 			int key = gameKey(event.key.keysym.scancode, &player);
@@ -278,11 +303,14 @@ run(void)
 		t = nt;
 		int width, height;
 		SDL_GetWindowSize(window, &width, &height);
+		/* The texture is stretched to the window by SDL_RenderCopy */
+		game_RenderSize(width, height, &width, &height);
 
 		static int prevWidth = 0, prevHeight = 0;
 		static cairo_surface_t *csurf = NULL;
 		static cairo_t *cr = NULL;
 		static void *framebuffer = NULL;
+		static SDL_Texture *texture = NULL;
 
 		if (prevWidth != width || prevHeight != height) {
 			prevWidth = width;
@@ -295,6 +323,12 @@ run(void)
 			if (cr != NULL) {
 				cairo_destroy(cr);
 			}
+			if (texture != NULL) {
+				SDL_DestroyTexture(texture);
+			}
+			texture = nullDie(SDL_CreateTexture(renderer,
+						SDL_PIXELFORMAT_ARGB8888,
+						SDL_TEXTUREACCESS_STREAMING, width, height));
 
 			framebuffer = erealloc(framebuffer, width * height * 32);
 			csurf = cairo_image_surface_create_for_data(
@@ -311,24 +345,25 @@ run(void)
 						cairo_status_to_string(cairo_status(cr)));
 				exit(1);
 			}
+			game_NewTarget();
 		}
 
-		if (!game_UpdateAndDraw(cr, dt, input, width, height)) {
-			return;
+		struct game_Damage damage;
+		if (!game_UpdateAndDraw(cr, dt, input, width, height, &damage)) {
+			goto out;
 		}
 		cairo_surface_flush(csurf);
-		SDL_Surface *surf =
-			nullDie(SDL_CreateRGBSurfaceFrom(framebuffer, width,
-						height, 32, width * 4,
-						0x00FF0000,  0x0000FF00,
-						0x000000FF, 0xFF000000));
-		SDL_Texture *texture = nullDie(SDL_CreateTextureFromSurface(renderer, surf));
+		for (int i = 0; i < damage.len; i++) {
+			struct game_Rect *r = &damage.rects[i];
+			SDL_Rect rect = {r->x, r->y, r->w, r->h};
+			uint8_t *pixels = (uint8_t *)framebuffer +
+				r->y * width * 4 + r->x * 4;
+			negativeDie(SDL_UpdateTexture(texture, &rect, pixels, width * 4));
+		}
 		SDL_RenderCopy(renderer, texture, NULL, NULL);
 		SDL_RenderPresent(renderer);
-		SDL_DestroyTexture(texture);
-		SDL_FreeSurface(surf);
 
-		for (int player = 0; player < 2; player++) {
+		for (int player = 0; player < input.players; player++) {
 			for (int i = 0; i < KEY_COUNT; i++) {
 				switch (input.keys[player][i]) {
 				case KEY_PRESSED:
@@ -343,6 +378,8 @@ run(void)
 			}
 		}
 	}
+out:
+	free(input.keys);
 }
 
 int
@@ -350,12 +387,17 @@ main(int argc, char *argv[])
 {
 	int x;
 	int flags = SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE;
+	char *script = NULL;
+	char *replay = NULL;
+	bool drawReplay = false;
 
 	if (argc > 1) {
-		while ((x = getopt(argc, argv, "vlf")) != -1) {
+		while ((x = getopt(argc, argv, "vlfs:t:H:r:p:P:C:k:")) != -1) {
 			switch (x) {
 			case 'v':
 				puts(NAME": " VERSION);
+				blit_Init();
+				printf("blit: %s\n", blit_Name());
 				return 0;
 			case 'l':
 				listFunc();
@@ -363,13 +405,42 @@ main(int argc, char *argv[])
 			case 'f':
 				flags |= SDL_WINDOW_FULLSCREEN;
 				break;
+			case 's':
+				game_SetScale(atoi(optarg));
+				break;
+			case 't':
+				game_SetTickRate(atoi(optarg));
+				break;
+			case 'H':
+				script = optarg;
+				break;
+			case 'C':
+				return game_CompileLevels(optarg);
+			case 'k':
+				return game_Pack(optarg);
+			case 'r':
+				game_RecordTo(optarg);
+				break;
+			case 'p':
+				replay = optarg;
+				break;
+			case 'P':
+				replay = optarg;
+				drawReplay = true;
+				break;
 			default:
-				fputs("Usage: fuyunix [-v|-l|-f]\n", stderr);
+				fputs("Usage: fuyunix [-v|-l|-f] [-s scale] [-t rate] [-r file]\n"
+				      "       [-H script|-p file|-P file|-C dir|-k dir]\n", stderr);
 				return 1;
 			}
 		}
 	}
 
+	if (script != NULL)
+		return headless_Run(script, stringToKey);
+	if (replay != NULL)
+		return headless_Replay(replay, drawReplay);
+
 	platform_Init(flags);
 
 	loadConfig();
@@ -14,15 +14,19 @@
 #include <wayland-cursor.h>
 #include <xkbcommon/xkbcommon.h>
 
+#include "blit.h"
 #include "scfg.h"
 #include "util.h"
 #include "game.h"
+#include "headless.h"
 #include "fuyunix.h"
 
 #include "../xdg-decoration-unstable-client-protocol.h"
 #include "../xdg-shell-client-protocol.h"
+#include "../viewporter-client-protocol.h"
 #include "../xdg-decoration-unstable-protocol.c"
 #include "../xdg-shell-protocol.c"
+#include "../viewporter-protocol.c"
 
 struct {
 	char *name;
@@ -55,6 +59,8 @@ struct Wayland {
 	struct wl_output *output;
 	struct zxdg_decoration_manager_v1 *decor_manager;
 	struct zxdg_toplevel_decoration_v1 *top_decor;
+	struct wp_viewporter *viewporter;
+	struct wp_viewport *viewport;
 
 	struct xkb_state *xkb_state;
 	struct xkb_keymap  *xkb_keymap;
@@ -97,7 +103,7 @@ static struct {
 	int is_key_allocated;
 } keys;
 
-_Static_assert(KEY_COUNT == 8, "Update keyList");
+_Static_assert(KEY_COUNT == 11, "Update keyList");
 
 static char *keysList[] = {
 	[KEY_UP]     = "up",
@@ -107,6 +113,9 @@ static char *keysList[] = {
 	[KEY_PAUSE]  = "pause",
 	[KEY_SHOOT]  = "shoot",
 	[KEY_QUIT]   = "quit",
+	[KEY_RESTART] = "restart",
+	[KEY_SAVE]   = "save",
+	[KEY_LOAD]   = "load",
 };
 
 static int
@@ -184,7 +193,7 @@ loadConfig(void)
 					exit(1);
 				}
 				int player = atoi(d->params[1]);
-				if (player <= 0) {
+				if (player <= 0 || player > MAX_PLAYERS) {
 					fprintf(stderr, "%s:%d: Invalid number %s\n",
 							filepath, d->lineno, d->params[1]);
 					exit(1);
@@ -223,6 +232,18 @@ listFunc(void)
 		printf("%s\n", keysList[i]);
 }
 
+/* Number of players that have keys */
+static int
+keyPlayers(void)
+{
+	int players = 1;
+	for (int i = 0; i < keys.keylen; i++) {
+		if (keys.key[i].player >= players)
+			players = keys.key[i].player + 1;
+	}
+	return players;
+}
+
 int
 gameKey(xkb_keysym_t key, int *p)
 {
@@ -246,6 +267,12 @@ gameKey(xkb_keysym_t key, int *p)
 		return KEY_QUIT;
 	case XKB_KEY_Escape:
 		return KEY_PAUSE;
+	case XKB_KEY_r:
+		return KEY_RESTART;
+	case XKB_KEY_F5:
+		return KEY_SAVE;
+	case XKB_KEY_F9:
+		return KEY_LOAD;
 	case XKB_KEY_Return: // fallthrough
 	case XKB_KEY_space:
 		return KEY_SELECT;
@@ -305,7 +332,8 @@ keyboard_handle_key(void *data, struct wl_keyboard *wl_keyboard, uint32_t
 
 	int player = 0;
 	int k = gameKey(keysym, &player);
-	if (k < 0)
+	/* The keys aren't allocated until the config is loaded */
+	if (k < 0 || player >= wl->game_input.players)
 		return;
 
 	if (keyState == WL_KEYBOARD_KEY_STATE_RELEASED) {
@@ -479,6 +507,9 @@ handle_global(void *data, struct wl_registry *registry,
 	} else if (strcmp(interface, zxdg_decoration_manager_v1_interface.name) == 0) {
 		wl->decor_manager = wl_registry_bind(registry, name,
 				&zxdg_decoration_manager_v1_interface, 1);
+	} else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+		wl->viewporter = wl_registry_bind(registry, name,
+				&wp_viewporter_interface, 1);
 	}
 }
 
@@ -606,8 +637,14 @@ platform_Init(struct Wayland *wl, bool fullscreen)
 		exit(1);
 	}
 
+	if (wl->viewporter == NULL) {
+		fprintf(stderr, "no wp_viewporter, drawing at the size of the window\n");
+		game_SetScale(0);
+	}
 
-	wl->buffer = newBuffer(wl->width, wl->height, wl->shm);
+	int width, height;
+	game_RenderSize(wl->width, wl->height, &width, &height);
+	wl->buffer = newBuffer(width, height, wl->shm);
 	clearBuffer(&wl->buffer);
 }
 
@@ -712,6 +749,11 @@ platform_Open(struct Wayland *wl)
 	xdg_toplevel_add_listener(wl->xdg_toplevel, &xdg_toplevel_listener, wl);
 	xdg_wm_base_add_listener(wl->xdg_wm_base, &xdg_wm_base_listener, wl);
 
+	if (wl->viewporter != NULL) {
+		wl->viewport = wp_viewporter_get_viewport(wl->viewporter, wl->surface);
+		wp_viewport_set_destination(wl->viewport, wl->width, wl->height);
+	}
+
 	xdg_toplevel_set_title(wl->xdg_toplevel, NAME);
 	xdg_toplevel_set_app_id(wl->xdg_toplevel, NAME);
 
@@ -750,10 +792,17 @@ wl_surface_frame_done(void *data, struct wl_callback *cb, uint32_t time)
 	cb = wl_surface_frame(wl->surface);
 	wl_callback_add_listener(cb, &wl_surface_frame_listener, wl);
 
+	int width, height;
+	game_RenderSize(wl->width, wl->height, &width, &height);
 	if (wl->configured) {
 		struct Buffer prev = wl->buffer;
-		wl->buffer = newBuffer(wl->width, wl->height, wl->shm);
+		wl->buffer = newBuffer(width, height, wl->shm);
 		freeBuffer(&prev);
+		game_NewTarget();
+
+		/* The compositor scales the buffer up to the size of the window */
+		if (wl->viewport != NULL)
+			wp_viewport_set_destination(wl->viewport, wl->width, wl->height);
 
 		wl->configured = false;
 	}
@@ -766,10 +815,12 @@ wl_surface_frame_done(void *data, struct wl_callback *cb, uint32_t time)
 	wl->game_input.ptr_x = wl->pointer.x;
 	wl->game_input.ptr_y = wl->pointer.y;
 
-	if (!game_UpdateAndDraw(wayland.buffer.cr, dt, wl->game_input, wl->width, wl->height)) {
+	struct game_Damage damage;
+	if (!game_UpdateAndDraw(wayland.buffer.cr, dt, wl->game_input,
+				width, height, &damage)) {
 		wl->quit = true;
 	}
-	for (int player = 0; player < 2; player++) {
+	for (int player = 0; player < wl->game_input.players; player++) {
 		for (int i = 0; i < KEY_COUNT; i++) {
 			switch (wl->game_input.keys[player][i]) {
 			case KEY_PRESSED:
@@ -784,8 +835,12 @@ wl_surface_frame_done(void *data, struct wl_callback *cb, uint32_t time)
 		}
 	}
 
+	cairo_surface_flush(wl->buffer.surf);
 	wl_surface_attach(wl->surface, wl->buffer.wl_buf, 0, 0);
-	wl_surface_damage_buffer(wl->surface, 0, 0, wl->width, wl->height);
+	for (int i = 0; i < damage.len; i++) {
+		struct game_Rect *r = &damage.rects[i];
+		wl_surface_damage_buffer(wl->surface, r->x, r->y, r->w, r->h);
+	}
 	wl_surface_commit(wl->surface);
 }
 
@@ -802,11 +857,16 @@ main(int argc, char *argv[])
 {
 	int x;
 	bool fullscreen = false;
+	char *script = NULL;
+	char *replay = NULL;
+	bool drawReplay = false;
 	if (argc > 1) {
-		while ((x = getopt(argc, argv, "vlf")) != -1) {
+		while ((x = getopt(argc, argv, "vlfs:t:H:r:p:P:C:k:")) != -1) {
 			switch (x) {
 			case 'v':
 				puts(NAME": " VERSION);
+				blit_Init();
+				printf("blit: %s\n", blit_Name());
 				return 0;
 			case 'l':
 				listFunc();
@@ -814,8 +874,32 @@ main(int argc, char *argv[])
 			case 'f':
 				fullscreen = true;
 				break;
+			case 's':
+				game_SetScale(atoi(optarg));
+				break;
+			case 't':
+				game_SetTickRate(atoi(optarg));
+				break;
+			case 'H':
+				script = optarg;
+				break;
+			case 'C':
+				return game_CompileLevels(optarg);
+			case 'k':
+				return game_Pack(optarg);
+			case 'r':
+				game_RecordTo(optarg);
+				break;
+			case 'p':
+				replay = optarg;
+				break;
+			case 'P':
+				replay = optarg;
+				drawReplay = true;
+				break;
 			default:
-				fputs("Usage: fuyunix [-v|-l|-f]\n", stderr);
+				fputs("Usage: fuyunix [-v|-l|-f] [-s scale] [-t rate] [-r file]\n"
+				      "       [-H script|-p file|-P file|-C dir|-k dir]\n", stderr);
 				return 1;
 			}
 		}
@@ -826,6 +910,11 @@ main(int argc, char *argv[])
 	wl->width = LOGICAL_WIDTH;
 	wl->height = LOGICAL_HEIGHT;
 
+	if (script != NULL)
+		return headless_Run(script, stringToKey);
+	if (replay != NULL)
+		return headless_Replay(replay, drawReplay);
+
 	platform_Init(wl, fullscreen);
 
 	game_Init();
@@ -836,12 +925,18 @@ main(int argc, char *argv[])
 	wl_callback_add_listener(cb, &wl_surface_frame_listener, wl);
 
 	loadConfig();
+	wl->game_input.players = keyPlayers();
+	wl->game_input.keys = ecalloc(wl->game_input.players,
+			sizeof(*wl->game_input.keys));
 
 	run(wl);
 
 	game_Quit();
+	free(wl->game_input.keys);
 
 	freeBuffer(&wl->buffer);
+	if (wl->viewport != NULL)
+		wp_viewport_destroy(wl->viewport);
 	xdg_toplevel_destroy(wl->xdg_toplevel);
 	xdg_surface_destroy(wl->xdg_surface);
 	xdg_wm_base_destroy(wl->xdg_wm_base);
@@ -0,0 +1,177 @@
+/*
+ *  Copyright 2021 Shaqeel Ahmad
+ *
+ *  This file is part of fuyunix.
+ *
+ *  fuyunix is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fuyunix is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fuyunix.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+#define POOL_MAX_THREADS 8
+#define POOL_QUEUE_SIZE 256
+
+struct Job {
+	pool_Func fn;
+	void *arg;
+	struct pool_Group *group;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	/* Signaled when a job is queued or the pool is shutting down */
+	pthread_cond_t work;
+	/* Signaled when a job is finished */
+	pthread_cond_t done;
+
+	struct Job queue[POOL_QUEUE_SIZE];
+	int head;
+	int len;
+
+	pthread_t threads[POOL_MAX_THREADS];
+	int threads_len;
+
+	bool quit;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+/* Runs the i-th queued job. Must be called with pool.lock held, unlocks
+ * it while running the job. */
+static void
+runJob(int i)
+{
+	struct Job job = pool.queue[(pool.head + i) % POOL_QUEUE_SIZE];
+	for (; i > 0; i--) {
+		pool.queue[(pool.head + i) % POOL_QUEUE_SIZE] =
+			pool.queue[(pool.head + i - 1) % POOL_QUEUE_SIZE];
+	}
+	pool.head = (pool.head + 1) % POOL_QUEUE_SIZE;
+	pool.len--;
+
+	pthread_mutex_unlock(&pool.lock);
+	job.fn(job.arg);
+	pthread_mutex_lock(&pool.lock);
+
+	job.group->pending--;
+	if (job.group->pending == 0)
+		pthread_cond_broadcast(&pool.done);
+}
+
+static void *
+worker(void *arg)
+{
+	pthread_mutex_lock(&pool.lock);
+	while (!pool.quit) {
+		if (pool.len == 0) {
+			pthread_cond_wait(&pool.work, &pool.lock);
+			continue;
+		}
+		runJob(0);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+void
+pool_Init(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	if (n > POOL_MAX_THREADS)
+		n = POOL_MAX_THREADS;
+
+	for (long i = 0; i < n; i++) {
+		int err = pthread_create(&pool.threads[pool.threads_len], NULL,
+				worker, NULL);
+		if (err) {
+			fprintf(stderr, "failed to create worker thread: %s\n",
+					strerror(err));
+			break;
+		}
+		pool.threads_len++;
+	}
+}
+
+/* Jobs are run on the calling thread if there are no workers or the queue
+ * is full. */
+void
+pool_Submit(struct pool_Group *group, pool_Func fn, void *arg)
+{
+	pthread_mutex_lock(&pool.lock);
+	if (pool.threads_len == 0 || pool.len == POOL_QUEUE_SIZE) {
+		pthread_mutex_unlock(&pool.lock);
+		fn(arg);
+		return;
+	}
+
+	pool.queue[(pool.head + pool.len) % POOL_QUEUE_SIZE] = (struct Job){
+		.fn = fn,
+		.arg = arg,
+		.group = group,
+	};
+	pool.len++;
+	group->pending++;
+	pthread_cond_signal(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/* Returns the position in the queue of the first job of group, or -1 */
+static int
+findJob(struct pool_Group *group)
+{
+	for (int i = 0; i < pool.len; i++) {
+		if (pool.queue[(pool.head + i) % POOL_QUEUE_SIZE].group == group)
+			return i;
+	}
+	return -1;
+}
+
+/* Waits for every job in group to finish, helping with its queued jobs in
+ * the meantime. Jobs of other groups are left to the workers so waiting
+ * on a frame never runs background work like level prefetches. */
+void
+pool_Wait(struct pool_Group *group)
+{
+	pthread_mutex_lock(&pool.lock);
+	while (group->pending > 0) {
+		int i = findJob(group);
+		if (i >= 0)
+			runJob(i);
+		else
+			pthread_cond_wait(&pool.done, &pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+void
+pool_Quit(void)
+{
+	pthread_mutex_lock(&pool.lock);
+	pool.quit = true;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (int i = 0; i < pool.threads_len; i++)
+		pthread_join(pool.threads[i], NULL);
+	pool.threads_len = 0;
+	pool.quit = false;
+}
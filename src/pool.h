@@ -0,0 +1,19 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+/*
+ * A small pool of worker threads. Jobs are submitted to a group, and
+ * pool_Wait returns once every job of that group has finished.
+ */
+struct pool_Group {
+	int pending;
+};
+
+typedef void (*pool_Func)(void *arg);
+
+void pool_Init(void);
+void pool_Submit(struct pool_Group *group, pool_Func fn, void *arg);
+void pool_Wait(struct pool_Group *group);
+void pool_Quit(void);
+
+#endif /* _POOL_H_ */
@@ -0,0 +1,233 @@
+/*
+ *  Copyright 2021 Shaqeel Ahmad
+ *
+ *  This file is part of fuyunix.
+ *
+ *  fuyunix is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fuyunix is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fuyunix.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * File layout, all numbers little endian:
+ *
+ *	"FYRP" u8 format u8 keys u8 players u16 level u16 tick_rate
+ *	u8 build_len build
+ *
+ * followed by one entry per frame:
+ *
+ *	u8 flags  bit 7 set if the frame time changed, bits 0-6 the number
+ *	          of key changes
+ *	[u64 dt]  the frame time, as the bits of a double
+ *	changes   two bytes each, the player and key << 2 | state
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cairo.h>
+
+#include "game.h"
+#include "replay.h"
+#include "util.h"
+
+#define REPLAY_MAGIC "FYRP"
+#define REPLAY_FORMAT 1
+#define REPLAY_NEW_DT 0x80
+
+static void
+putU16(FILE *f, unsigned v)
+{
+	fputc(v & 0xFF, f);
+	fputc(v >> 8 & 0xFF, f);
+}
+
+static bool
+getU16(FILE *f, int *v)
+{
+	int lo = fgetc(f);
+	int hi = fgetc(f);
+	if (lo == EOF || hi == EOF)
+		return false;
+	*v = lo | hi << 8;
+	return true;
+}
+
+/* What the platforms turn a key state into on the next frame when there
+ * is no event for it */
+static KeyState
+nextState(KeyState s)
+{
+	switch (s) {
+	case KEY_PRESSED:
+		return KEY_PRESSED_REPEAT;
+	case KEY_RELEASED:
+		return KEY_UNKNOWN;
+	default:
+		return s;
+	}
+}
+
+bool
+replay_Create(struct Replay *r, const char *path, struct replay_Header *header)
+{
+	*r = (struct Replay){0};
+	r->f = fopen(path, "wb");
+	if (r->f == NULL) {
+		perror(path);
+		return false;
+	}
+	r->header = *header;
+	r->last.keys = ecalloc(MAX_PLAYERS, sizeof(*r->last.keys));
+	r->last.players = MAX_PLAYERS;
+
+	size_t len = strnlen(header->build, REPLAY_BUILD_LEN - 1);
+	fwrite(REPLAY_MAGIC, 1, 4, r->f);
+	fputc(REPLAY_FORMAT, r->f);
+	fputc(KEY_COUNT, r->f);
+	fputc(header->numplayers, r->f);
+	putU16(r->f, header->level);
+	putU16(r->f, header->tickRate);
+	fputc(len, r->f);
+	fwrite(header->build, 1, len, r->f);
+	return true;
+}
+
+bool
+replay_Open(struct Replay *r, const char *path)
+{
+	*r = (struct Replay){0};
+	r->f = fopen(path, "rb");
+	if (r->f == NULL) {
+		perror(path);
+		return false;
+	}
+
+	char magic[4];
+	if (fread(magic, 1, 4, r->f) != 4 || memcmp(magic, REPLAY_MAGIC, 4) != 0) {
+		fprintf(stderr, "%s: not a replay file\n", path);
+		goto err;
+	}
+	int format = fgetc(r->f);
+	int keys = fgetc(r->f);
+	if (format != REPLAY_FORMAT || keys != KEY_COUNT) {
+		fprintf(stderr, "%s: unsupported replay format\n", path);
+		goto err;
+	}
+	r->header.numplayers = fgetc(r->f);
+	int len = EOF;
+	if (!getU16(r->f, &r->header.level) ||
+			!getU16(r->f, &r->header.tickRate) ||
+			(len = fgetc(r->f)) == EOF) {
+		fprintf(stderr, "%s: truncated replay header\n", path);
+		goto err;
+	}
+	/* replay_Create never writes more, and build has to fit the rest */
+	if (len >= REPLAY_BUILD_LEN) {
+		fprintf(stderr, "%s: corrupt replay header\n", path);
+		goto err;
+	}
+	if (fread(r->header.build, 1, len, r->f) != (size_t)len) {
+		fprintf(stderr, "%s: truncated replay header\n", path);
+		goto err;
+	}
+	r->header.build[len] = '\0';
+	r->last.keys = ecalloc(MAX_PLAYERS, sizeof(*r->last.keys));
+	r->last.players = MAX_PLAYERS;
+	return true;
+err:
+	fclose(r->f);
+	r->f = NULL;
+	return false;
+}
+
+void
+replay_Write(struct Replay *r, double dt, struct game_Input *input)
+{
+	uint8_t changes[MAX_PLAYERS * KEY_COUNT][2];
+	int n = 0;
+	for (int p = 0; p < MAX_PLAYERS; p++) {
+		for (int k = 0; k < KEY_COUNT; k++) {
+			KeyState s = p < input->players ?
+				input->keys[p][k] : KEY_UNKNOWN;
+			if (s != nextState(r->last.keys[p][k])) {
+				changes[n][0] = p;
+				changes[n][1] = k << 2 | s;
+				n++;
+			}
+			r->last.keys[p][k] = s;
+		}
+	}
+
+	bool newDt = dt != r->dt;
+	fputc((newDt ? REPLAY_NEW_DT : 0) | n, r->f);
+	if (newDt) {
+		uint64_t bits;
+		memcpy(&bits, &dt, sizeof(bits));
+		for (int i = 0; i < 8; i++)
+			fputc(bits >> (i * 8) & 0xFF, r->f);
+		r->dt = dt;
+	}
+	fwrite(changes, 2, n, r->f);
+}
+
+/* Reads the next frame into dt and input. Returns false at the end of the
+ * replay. The keys of input are only valid until the next call. */
+bool
+replay_Read(struct Replay *r, double *dt, struct game_Input *input)
+{
+	int flags = fgetc(r->f);
+	if (flags == EOF)
+		return false;
+
+	if (flags & REPLAY_NEW_DT) {
+		uint64_t bits = 0;
+		for (int i = 0; i < 8; i++) {
+			int c = fgetc(r->f);
+			if (c == EOF)
+				return false;
+			bits |= (uint64_t)c << (i * 8);
+		}
+		memcpy(&r->dt, &bits, sizeof(r->dt));
+	}
+
+	for (int p = 0; p < MAX_PLAYERS; p++) {
+		for (int k = 0; k < KEY_COUNT; k++)
+			r->last.keys[p][k] = nextState(r->last.keys[p][k]);
+	}
+	for (int i = 0; i < (flags & ~REPLAY_NEW_DT); i++) {
+		int p = fgetc(r->f);
+		int c = fgetc(r->f);
+		if (p == EOF || c == EOF)
+			return false;
+		if (p >= MAX_PLAYERS || (c >> 2) >= KEY_COUNT)
+			continue;
+		r->last.keys[p][c >> 2] = c & 3;
+	}
+
+	*dt = r->dt;
+	*input = r->last;
+	return true;
+}
+
+void
+replay_Close(struct Replay *r)
+{
+	if (r->f != NULL)
+		fclose(r->f);
+	r->f = NULL;
+	free(r->last.keys);
+	r->last.keys = NULL;
+}
@@ -0,0 +1,39 @@
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+/*
+ * Recordings of the input of a level, one entry per frame with the time
+ * it took and the keys that changed from what the platform would report
+ * if nothing was pressed or released, so a frame with no changes costs a
+ * byte. Played back with the same build and tick rate they give exactly
+ * the same result.
+ *
+ * Frames are recorded rather than ticks since presses and releases, pause
+ * and the snapshot keys all act once per frame, in between ticks. Given
+ * the same frame times the game runs the same ticks after each frame, so
+ * the ticks are reproduced too.
+ */
+
+#define REPLAY_BUILD_LEN 64
+
+struct replay_Header {
+	int level;
+	int numplayers;
+	int tickRate;
+	char build[REPLAY_BUILD_LEN];
+};
+
+struct Replay {
+	FILE *f;
+	struct replay_Header header;
+	struct game_Input last;
+	double dt;
+};
+
+bool replay_Create(struct Replay *r, const char *path, struct replay_Header *header);
+bool replay_Open(struct Replay *r, const char *path);
+void replay_Write(struct Replay *r, double dt, struct game_Input *input);
+bool replay_Read(struct Replay *r, double *dt, struct game_Input *input);
+void replay_Close(struct Replay *r);
+
+#endif /* _REPLAY_H_ */
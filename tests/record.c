@@ -0,0 +1,146 @@
+/*
+ *  Copyright 2021 Shaqeel Ahmad
+ *
+ *  This file is part of fuyunix.
+ *
+ *  fuyunix is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fuyunix is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fuyunix.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Records two players picking level 1 from the level select and playing
+ * it with uneven frame times, plays the recording back and checks both
+ * end up exactly where they were. Run from the top of the tree. */
+
+#undef GAME_DATA_DIR
+#define GAME_DATA_DIR "data/"
+
+#include "../src/game.c"
+#include "../src/atlas.c"
+#include "../src/asset.c"
+#include "../src/pack.c"
+#include "../src/entity.c"
+#include "../src/pool.c"
+#include "../src/blit.c"
+#include "../src/replay.c"
+#include "../src/scfg.c"
+#include "../src/util.c"
+
+#include <unistd.h>
+
+#define PLAYERS 2
+#define FRAMES 400
+
+static char path[] = "/tmp/fuyunix-record-XXXXXX";
+
+/* The frame that picks the level runs several ticks */
+static const double frameTimes[] = {1.0 / 60, 0.03, 1.0 / 144, 1.0 / 75};
+
+/* Whether player p holds key k on frame f. The second player already
+ * holds up when the first one picks the level on frame 1. */
+static bool
+holds(int f, int p, int k)
+{
+	if (p == 0) {
+		if (f == 1)
+			return k == KEY_SELECT;
+		return f > 1 && ((k == KEY_RIGHT && f < 60) ||
+				(k == KEY_LEFT && f > 150 && f < 200) ||
+				(k == KEY_UP && f % 90 < 30));
+	}
+	return (k == KEY_UP && (f < 60 || f % 70 < 20)) ||
+		(k == KEY_RIGHT && f > 100 && f < 160);
+}
+
+int
+main(void)
+{
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+	close(fd);
+
+	game_InitHeadless();
+	game_RecordTo(path);
+	game.state = STATE_LEVEL_SELECT;
+	game.curLevel = 0;
+	game.numplayers = PLAYERS - 1;
+
+	KeyState keys[MAX_PLAYERS][KEY_COUNT] = {0};
+	bool held[PLAYERS][KEY_COUNT] = {0};
+	for (int f = 0; f < FRAMES; f++) {
+		for (int p = 0; p < PLAYERS; p++) {
+			for (int k = 0; k < KEY_COUNT; k++) {
+				bool h = holds(f, p, k);
+				if (h)
+					keys[p][k] = held[p][k] ? KEY_PRESSED_REPEAT : KEY_PRESSED;
+				else
+					keys[p][k] = held[p][k] ? KEY_RELEASED : KEY_UNKNOWN;
+				held[p][k] = h;
+			}
+		}
+		struct game_Input input = {.keys = keys, .players = PLAYERS};
+		game_Frame(frameTimes[f % 4], input);
+	}
+	if (game.state != STATE_PLAY) {
+		fprintf(stderr, "FAIL: level isn't being played after the run\n");
+		return 1;
+	}
+	replay_Close(&game.record);
+	game.recordPath = NULL;
+
+	double want[PLAYERS][2];
+	for (int p = 0; p < PLAYERS; p++)
+		game_PlayerPosition(p, &want[p][0], &want[p][1]);
+	long wantTicks = game_Ticks();
+
+	struct Replay r;
+	if (!replay_Open(&r, path))
+		return 1;
+	int failed = 0;
+	if (r.header.level != 1 || r.header.numplayers != PLAYERS) {
+		fprintf(stderr, "FAIL: recorded level %d with %d players\n",
+				r.header.level, r.header.numplayers);
+		failed = 1;
+	}
+	game_SetTickRate(r.header.tickRate);
+	game_StartLevel(r.header.level - 1, r.header.numplayers);
+	double dt;
+	struct game_Input input;
+	while (replay_Read(&r, &dt, &input))
+		game_Frame(dt, input);
+	replay_Close(&r);
+
+	if (game_Ticks() != wantTicks) {
+		fprintf(stderr, "FAIL: replay ran %ld ticks, recorded %ld\n",
+				game_Ticks(), wantTicks);
+		failed = 1;
+	}
+	for (int p = 0; p < PLAYERS; p++) {
+		double x, y;
+		game_PlayerPosition(p, &x, &y);
+		if (x != want[p][0] || y != want[p][1]) {
+			fprintf(stderr, "FAIL: player %d replayed to %.17g,%.17g, "
+					"recorded at %.17g,%.17g\n",
+					p + 1, x, y, want[p][0], want[p][1]);
+			failed = 1;
+		}
+	}
+
+	game_Quit();
+	remove(path);
+	if (!failed)
+		printf("record: ok\n");
+	return failed;
+}
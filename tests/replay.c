@@ -0,0 +1,120 @@
+/*
+ *  Copyright 2021 Shaqeel Ahmad
+ *
+ *  This file is part of fuyunix.
+ *
+ *  fuyunix is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fuyunix is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fuyunix.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Checks that replay_Open takes what replay_Create writes and turns down
+ * truncated and corrupt headers instead of reading past them. */
+
+#include "../src/replay.c"
+#include "../src/util.c"
+
+#include <unistd.h>
+
+static char path[] = "/tmp/fuyunix-replay-XXXXXX";
+static int failed;
+
+static void
+writeFile(const unsigned char *data, size_t len)
+{
+	FILE *f = fopen(path, "wb");
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+	fwrite(data, 1, len, f);
+	fclose(f);
+}
+
+static void
+expectOpen(const char *what, bool want)
+{
+	struct Replay r;
+	bool ok = replay_Open(&r, path);
+	if (ok)
+		replay_Close(&r);
+	if (ok != want) {
+		fprintf(stderr, "FAIL: %s: replay_Open returned %d\n", what, ok);
+		failed = 1;
+	}
+}
+
+int
+main(void)
+{
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+	close(fd);
+
+	struct replay_Header header = {.level = 3, .numplayers = 2, .tickRate = 120};
+	strcpy(header.build, "test");
+	struct Replay r;
+	if (!replay_Create(&r, path, &header))
+		return 1;
+	replay_Close(&r);
+
+	unsigned char good[256];
+	FILE *f = fopen(path, "rb");
+	size_t good_len = fread(good, 1, sizeof(good), f);
+	fclose(f);
+
+	expectOpen("valid header", true);
+	if (replay_Open(&r, path)) {
+		if (r.header.level != 3 || r.header.numplayers != 2 ||
+				r.header.tickRate != 120 || strcmp(r.header.build, "test") != 0) {
+			fprintf(stderr, "FAIL: header doesn't round trip\n");
+			failed = 1;
+		}
+		replay_Close(&r);
+	}
+
+	for (size_t len = 0; len < good_len; len++) {
+		char what[64];
+		snprintf(what, sizeof(what), "header truncated to %zu bytes", len);
+		writeFile(good, len);
+		expectOpen(what, false);
+	}
+
+	/* The build length byte comes right before the build */
+	size_t build_len = good_len - strlen(header.build) - 1;
+	unsigned char big[512];
+	memcpy(big, good, build_len);
+	memset(big + build_len + 1, 'x', sizeof(big) - build_len - 1);
+
+	big[build_len] = REPLAY_BUILD_LEN;
+	writeFile(big, build_len + 1 + REPLAY_BUILD_LEN);
+	expectOpen("build as long as the buffer", false);
+
+	big[build_len] = 255;
+	writeFile(big, build_len + 1 + 255);
+	expectOpen("longest build", false);
+
+	writeFile(big, build_len + 1 + 8);
+	expectOpen("oversized and truncated build", false);
+
+	big[build_len] = REPLAY_BUILD_LEN - 1;
+	writeFile(big, build_len + 1 + REPLAY_BUILD_LEN - 1);
+	expectOpen("longest build that fits", true);
+
+	remove(path);
+	if (!failed)
+		printf("replay: ok\n");
+	return failed;
+}
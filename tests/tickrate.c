@@ -0,0 +1,108 @@
+/*
+ *  Copyright 2021 Shaqeel Ahmad
+ *
+ *  This file is part of fuyunix.
+ *
+ *  fuyunix is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  fuyunix is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with fuyunix.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Checks that a player ends up in the same place at any tick rate when the
+ * keys are held for the same time. Run from the top of the tree, it plays
+ * the first level in data/. */
+
+#undef GAME_DATA_DIR
+#define GAME_DATA_DIR "data/"
+
+#include "../src/game.c"
+#include "../src/atlas.c"
+#include "../src/asset.c"
+#include "../src/pack.c"
+#include "../src/entity.c"
+#include "../src/pool.c"
+#include "../src/blit.c"
+#include "../src/replay.c"
+#include "../src/scfg.c"
+#include "../src/util.c"
+
+/* Pixels the positions at different rates may be apart */
+#define TOLERANCE 2.0
+
+static const int rates[] = {60, 120, 240};
+
+struct Hold {
+	double secs;
+	bool right;
+	bool up;
+};
+
+/* Runs right, then right and up, then nothing */
+static const struct Hold holds[] = {
+	{0.25, true, false},
+	{0.25, true, true},
+	{0.5, false, false},
+};
+
+static void
+run(int rate, double *x, double *y)
+{
+	game_SetTickRate(rate);
+	if (!game_StartLevel(0, 1)) {
+		fprintf(stderr, "FAIL: can't start level 1\n");
+		exit(1);
+	}
+	bool held[KEY_COUNT] = {0};
+	for (size_t h = 0; h < sizeof(holds) / sizeof(holds[0]); h++) {
+		bool want[KEY_COUNT] = {0};
+		want[KEY_RIGHT] = holds[h].right;
+		want[KEY_UP] = holds[h].up;
+		long ticks = lround(holds[h].secs * rate);
+		for (long t = 0; t < ticks; t++) {
+			KeyState keys[MAX_PLAYERS][KEY_COUNT] = {0};
+			struct game_Input input = {.keys = keys, .players = 1};
+			for (int k = 0; k < KEY_COUNT; k++) {
+				if (want[k])
+					keys[0][k] = held[k] ? KEY_PRESSED_REPEAT : KEY_PRESSED;
+				else if (held[k])
+					keys[0][k] = KEY_RELEASED;
+				held[k] = want[k];
+			}
+			game_Tick(input);
+		}
+	}
+	game_PlayerPosition(0, x, y);
+}
+
+int
+main(void)
+{
+	game_InitHeadless();
+
+	int failed = 0;
+	double x0, y0;
+	run(rates[0], &x0, &y0);
+	for (size_t i = 1; i < sizeof(rates) / sizeof(rates[0]); i++) {
+		double x, y;
+		run(rates[i], &x, &y);
+		if (fabs(x - x0) > TOLERANCE || fabs(y - y0) > TOLERANCE) {
+			fprintf(stderr, "FAIL: %d ticks/s ends at %g,%g, %d at %g,%g\n",
+					rates[0], x0, y0, rates[i], x, y);
+			failed = 1;
+		}
+	}
+
+	game_Quit();
+	if (!failed)
+		printf("tickrate: ok\n");
+	return failed;
+}
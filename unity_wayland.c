@@ -1,4 +1,12 @@
 #include "src/game.c"
+#include "src/atlas.c"
+#include "src/asset.c"
+#include "src/pack.c"
+#include "src/entity.c"
+#include "src/pool.c"
+#include "src/blit.c"
+#include "src/headless.c"
+#include "src/replay.c"
 #include "src/platform_wayland.c"
 #include "src/scfg.c"
 #include "src/util.c"